@@ -0,0 +1,82 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QTime>
+
+#include "common/pipeline.h"
+#include "common/resource.h"
+
+/**
+ * Rebuilds the indexes of a resource from its entity store, i.e. after a new indexer was added or an index got corrupted.
+ * With --migrate-keys the entities that are still stored with their printable key are rekeyed first.
+ *
+ * The resource must not be running while its indexes are rebuilt.
+ */
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser cliOptions;
+    cliOptions.setApplicationDescription(QObject::tr("Rebuilds the indexes of a resource that is not running"));
+    cliOptions.addHelpOption();
+    cliOptions.addPositionalArgument(QObject::tr("[resource]"),
+                                     QObject::tr("The resource whose indexes are rebuilt"));
+    QCommandLineOption typeOption(QStringList() << "t" << "type", QObject::tr("The entity type whose indexes are rebuilt"), QObject::tr("type"), "event");
+    cliOptions.addOption(typeOption);
+    QCommandLineOption indexerOption(QStringList() << "i" << "indexer", QObject::tr("Only run the indexer with this id, can be given several times"), QObject::tr("id"));
+    cliOptions.addOption(indexerOption);
+    QCommandLineOption partitionsOption(QStringList() << "p" << "partitions", QObject::tr("The number of partitions the entity store is read in"), QObject::tr("count"), "0");
+    cliOptions.addOption(partitionsOption);
+    QCommandLineOption migrateOption(QStringList() << "m" << "migrate-keys", QObject::tr("Rekey entities that are stored with their printable key and rebuild all indexes"));
+    cliOptions.addOption(migrateOption);
+    cliOptions.process(app);
+
+    const QStringList arguments = cliOptions.positionalArguments();
+    const QString resourceName = arguments.isEmpty() ? QString("org.kde.dummy") : arguments.first();
+
+    Akonadi2::ResourceFactory *resourceFactory = Akonadi2::ResourceFactory::load(resourceName);
+    if (!resourceFactory) {
+        qWarning() << "Failed to load resource " << resourceName;
+        return 1;
+    }
+    Akonadi2::Resource *resource = resourceFactory->createResource();
+    Akonadi2::Pipeline pipeline(resourceName);
+    //The event loop is never entered, so the resource doesn't process any commands
+    resource->configurePipeline(&pipeline);
+
+    QTime time;
+    time.start();
+    QStringList indexers = cliOptions.values(indexerOption);
+    if (cliOptions.isSet(migrateOption)) {
+        const int migrated = pipeline.migrateEntityKeys();
+        if (migrated < 0) {
+            qWarning() << "Failed to migrate the entity keys of " << resourceName;
+            delete resource;
+            return 1;
+        }
+        qDebug() << "Migrated " << migrated << " entities of " << resourceName << " in " << time.elapsed() << " ms";
+        //Every index refers to the entities by key
+        indexers.clear();
+    }
+    const bool success = pipeline.rebuildIndexes(cliOptions.value(typeOption), indexers, cliOptions.value(partitionsOption).toInt());
+    qDebug() << "Rebuilt indexes of " << resourceName << " in " << time.elapsed() << " ms";
+    delete resource;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "bloomfilter.h"
+#include <QDataStream>
+#include <cmath>
+
+static const quint32 s_version = 1;
+
+//64 bit FNV-1a, independent of the hash function Qt uses
+static quint64 hash(const QByteArray &key, quint64 basis)
+{
+    quint64 h = basis;
+    for (const char c : key) {
+        h ^= static_cast<unsigned char>(c);
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+BloomFilter::BloomFilter()
+    : mHashes(0),
+    mCount(0),
+    mCapacity(0)
+{
+}
+
+BloomFilter::BloomFilter(int capacity, double falsePositiveRate)
+    : mHashes(0),
+    mCount(0),
+    mCapacity(qMax(capacity, 1))
+{
+    const double ln2 = std::log(2.0);
+    const qint64 bits = qMax<qint64>(64, static_cast<qint64>(std::ceil(-mCapacity * std::log(falsePositiveRate) / (ln2 * ln2))));
+    mBits = QByteArray(static_cast<int>((bits + 7) / 8), 0);
+    mHashes = qBound(1, static_cast<int>(std::round(static_cast<double>(mBits.size() * 8) / mCapacity * ln2)), 16);
+}
+
+bool BloomFilter::isNull() const
+{
+    return mBits.isEmpty();
+}
+
+//Derives all bit positions from two hashes, which is as good as independent hash functions
+template<typename F>
+static void forEachBit(const QByteArray &key, int hashes, quint64 bits, F f)
+{
+    const quint64 h1 = hash(key, Q_UINT64_C(14695981039346656037));
+    const quint64 h2 = hash(key, Q_UINT64_C(9650029242287828579)) | 1;
+    for (int i = 0; i < hashes; i++) {
+        if (!f((h1 + i * h2) % bits)) {
+            return;
+        }
+    }
+}
+
+void BloomFilter::add(const QByteArray &key)
+{
+    if (isNull()) {
+        return;
+    }
+    char *data = mBits.data();
+    forEachBit(key, mHashes, static_cast<quint64>(mBits.size()) * 8, [data](quint64 bit) -> bool {
+        data[bit / 8] |= static_cast<char>(1 << (bit % 8));
+        return true;
+    });
+    mCount++;
+}
+
+bool BloomFilter::mayContain(const QByteArray &key) const
+{
+    if (isNull()) {
+        return true;
+    }
+    bool found = true;
+    const char *data = mBits.constData();
+    forEachBit(key, mHashes, static_cast<quint64>(mBits.size()) * 8, [data, &found](quint64 bit) -> bool {
+        found = data[bit / 8] & (1 << (bit % 8));
+        return found;
+    });
+    return found;
+}
+
+int BloomFilter::count() const
+{
+    return mCount;
+}
+
+int BloomFilter::capacity() const
+{
+    return mCapacity;
+}
+
+double BloomFilter::estimatedFalsePositiveRate() const
+{
+    if (isNull()) {
+        return 1;
+    }
+    return std::pow(1 - std::exp(-static_cast<double>(mHashes) * mCount / (mBits.size() * 8.0)), mHashes);
+}
+
+QByteArray BloomFilter::serialize() const
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << s_version << static_cast<qint32>(mHashes) << static_cast<qint32>(mCount) << static_cast<qint32>(mCapacity) << mBits;
+    return data;
+}
+
+BloomFilter BloomFilter::deserialize(const QByteArray &data)
+{
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 version = 0;
+    qint32 hashes = 0;
+    qint32 count = 0;
+    qint32 capacity = 0;
+    QByteArray bits;
+    stream >> version >> hashes >> count >> capacity >> bits;
+    BloomFilter filter;
+    if (stream.status() != QDataStream::Ok || version != s_version || hashes <= 0 || bits.isEmpty()) {
+        return filter;
+    }
+    filter.mHashes = hashes;
+    filter.mCount = count;
+    filter.mCapacity = capacity;
+    filter.mBits = bits;
+    return filter;
+}
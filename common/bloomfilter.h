@@ -0,0 +1,38 @@
+#pragma once
+
+#include <QByteArray>
+
+/**
+ * A set of keys that can only tell for sure that a key is absent.
+ *
+ * The hash functions are part of the serialized format, so a persisted filter stays valid across processes and Qt versions.
+ */
+class BloomFilter
+{
+public:
+    //A null filter, which may contain any key
+    BloomFilter();
+    //Sized so the false positive rate stays below falsePositiveRate until capacity keys have been added
+    BloomFilter(int capacity, double falsePositiveRate);
+
+    bool isNull() const;
+    void add(const QByteArray &key);
+    //False if the key was definitely never added
+    bool mayContain(const QByteArray &key) const;
+
+    //The number of added keys
+    int count() const;
+    int capacity() const;
+    //The expected false positive rate for the added keys
+    double estimatedFalsePositiveRate() const;
+
+    QByteArray serialize() const;
+    //Returns a null filter if the data is not a valid filter
+    static BloomFilter deserialize(const QByteArray &data);
+
+private:
+    QByteArray mBits;
+    int mHashes;
+    int mCount;
+    int mCapacity;
+};
@@ -229,6 +229,10 @@ public:
 
     virtual QVariant getProperty(const QString &key) const { return mAdaptor->getProperty(key); }
     virtual void setProperty(const QString &key, const QVariant &value){ mChangeSet.insert(key, value); mAdaptor->setProperty(key, value); }
+    //The properties that have been set since the object was loaded. Properties set to an invalid value are removed.
+    QStringList changedProperties() const { return mChangeSet.keys(); }
+    QString identifier() const { return mIdentifier; }
+    qint64 revision() const { return mRevision; }
 
 private:
     QSharedPointer<BufferAdaptor> mAdaptor;
@@ -297,15 +301,39 @@ using namespace async;
 class Query
 {
 public:
-    Query() : syncOnDemand(true), processAll(false) {}
+    Query() : sortDescending(false), limit(0), syncOnDemand(true), processAll(false) {}
     //Could also be a propertyFilter
     QStringList resources;
     //Could also be a propertyFilter
     QStringList ids;
-    //Filters to apply
+    //Inclusive bounds of a range filter, an invalid bound is unlimited
+    struct Range {
+        QVariant lower;
+        QVariant upper;
+    };
+
+    //Matches entities whose interval from the start to the end property overlaps the range.
+    //Entities without end property are treated as a point in time.
+    struct Overlap {
+        QString startProperty;
+        QString endProperty;
+        Range range;
+    };
+
+    //Filters to apply. A list of values matches any of them.
     QHash<QString, QVariant> propertyFilter;
+    QHash<QString, Range> rangeFilter;
+    //Only applies if the start property is set
+    Overlap overlapFilter;
+    //Words that all have to occur in the full-text indexed properties. A trailing * matches all words starting with the word.
+    QString textSearch;
     //Properties to retrieve
     QSet<QString> requestedProperties;
+    //Results are ordered by this property if set. Entities without the property follow all others, in either direction.
+    QString sortProperty;
+    bool sortDescending;
+    //The maximum number of results, 0 for all
+    int limit;
     bool syncOnDemand;
     bool processAll;
 };
@@ -471,7 +499,9 @@ public:
     static void modify(const DomainType &domainObject, const QString &resourceIdentifier) {
         //Potentially move to separate thread as well
         auto facade = FacadeFactory::instance().getFacade<DomainType>(resourceIdentifier);
-        facade.modify(domainObject);
+        auto job = facade->modify(domainObject);
+        auto future = job.exec();
+        future.waitForFinished();
     }
 
     /**
@@ -481,7 +511,9 @@ public:
     static void remove(const DomainType &domainObject, const QString &resourceIdentifier) {
         //Potentially move to separate thread as well
         auto facade = FacadeFactory::instance().getFacade<DomainType>(resourceIdentifier);
-        facade.remove(domainObject);
+        auto job = facade->remove(domainObject);
+        auto future = job.exec();
+        future.waitForFinished();
     }
 
     static void shutdown(const QString &resourceIdentifier);
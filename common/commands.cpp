@@ -20,6 +20,8 @@
 
 #include "commands.h"
 
+#include "queuedcommand_generated.h"
+
 #include <QIODevice>
 
 namespace Akonadi2
@@ -61,6 +63,16 @@ void write(QIODevice *device, int messageId, int commandId, flatbuffers::FlatBuf
     device->write((const char*)fbb.GetBufferPointer(), dataSize);
 }
 
+void createQueuedCommand(flatbuffers::FlatBufferBuilder &fbb, int commandId, const void *command, size_t size)
+{
+    auto commandData = fbb.CreateVector(static_cast<uint8_t const *>(command), size);
+    auto builder = Akonadi2::QueuedCommandBuilder(fbb);
+    builder.add_commandId(commandId);
+    builder.add_command(commandData);
+    auto buffer = builder.Finish();
+    Akonadi2::FinishQueuedCommandBuffer(fbb, buffer);
+}
+
 } // namespace Commands
 
 } // namespace Akonadi2
@@ -43,6 +43,8 @@ enum CommandIds {
     CreateEntityCommand,
     SearchSourceCommand, // need a buffer definition for this, but relies on Query API
     ShutdownCommand,
+    DeadLettersCommand,
+    ClientQueueUpdateCommand,
     CustomCommand = 0xffff
 };
 
@@ -50,6 +52,8 @@ int AKONADI2COMMON_EXPORT headerSize();
 void AKONADI2COMMON_EXPORT write(QIODevice *device, int messageId, int commandId);
 void AKONADI2COMMON_EXPORT write(QIODevice *device, int messageId, int commandId, const char *buffer, uint size);
 void AKONADI2COMMON_EXPORT write(QIODevice *device, int messageId, int commandId, flatbuffers::FlatBufferBuilder &fbb);
+//Wraps the command into a QueuedCommand buffer, as stored in the command queues of a resource
+void AKONADI2COMMON_EXPORT createQueuedCommand(flatbuffers::FlatBufferBuilder &fbb, int commandId, const void *command, size_t size);
 
 }
 
@@ -63,12 +63,27 @@ public:
 // {
 // };
 
+//The type independent part of the factory, so the pipeline can work with the buffers of all entity types.
+class DomainTypeAdaptorFactoryInterface
+{
+public:
+    typedef QSharedPointer<DomainTypeAdaptorFactoryInterface> Ptr;
+    virtual ~DomainTypeAdaptorFactoryInterface() {};
+    virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity) = 0;
+    //Creates an entity buffer without metadata. Properties that are not set are left out of the buffer.
+    virtual void createBuffer(const Akonadi2::Domain::AkonadiDomainType &domainObject, flatbuffers::FlatBufferBuilder &fbb) = 0;
+    //Verifies the resource and local buffers of an entity before it is written to storage.
+    //createAdaptor relies on this and doesn't verify entities read from storage again.
+    virtual bool verifyBuffers(const Akonadi2::Entity &entity) = 0;
+};
+
 template<typename DomainType, typename LocalBuffer, typename ResourceBuffer>
-class DomainTypeAdaptorFactory/* <typename DomainType, LocalBuffer, ResourceBuffer> */
+class DomainTypeAdaptorFactory/* <typename DomainType, LocalBuffer, ResourceBuffer> */ : public DomainTypeAdaptorFactoryInterface
 {
 public:
     virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity) = 0;
-    virtual void createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb) {};
+    virtual void createBuffer(const Akonadi2::Domain::AkonadiDomainType &domainObject, flatbuffers::FlatBufferBuilder &fbb) {};
+    virtual bool verifyBuffers(const Akonadi2::Entity &entity) { return true; };
 
 protected:
     QSharedPointer<PropertyMapper<LocalBuffer> > mLocalMapper;
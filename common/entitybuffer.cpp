@@ -6,9 +6,13 @@
 
 using namespace Akonadi2;
 
-EntityBuffer::EntityBuffer(void *dataValue, int dataSize)
+EntityBuffer::EntityBuffer(void *dataValue, int dataSize, Trust trust)
     : mEntity(nullptr)
 {
+    if (trust == Trusted && !verifyTrustedBuffers()) {
+        mEntity = Akonadi2::GetEntity(dataValue);
+        return;
+    }
     flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(dataValue), dataSize);
     // Q_ASSERT(Akonadi2::VerifyEntity(verifyer));
     if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
@@ -18,6 +22,17 @@ EntityBuffer::EntityBuffer(void *dataValue, int dataSize)
     }
 }
 
+bool EntityBuffer::verifyTrustedBuffers()
+{
+    static const bool verify = qgetenv("AKONADI2_VERIFY_BUFFERS") == "1";
+    return verify;
+}
+
+bool EntityBuffer::isValid() const
+{
+    return mEntity != nullptr;
+}
+
 const Akonadi2::Entity &EntityBuffer::entity()
 {
     return *mEntity;
@@ -70,3 +85,59 @@ void EntityBuffer::assembleEntityBuffer(flatbuffers::FlatBufferBuilder &fbb, voi
     Akonadi2::FinishEntityBuffer(fbb, buffer);
 }
 
+/*
+ * The entity table has a fixed layout, so we can write it directly:
+ * root offset | vtable | padding | table (vtable offset + 3 vector offsets) | metadata | resource | local
+ * Each vector is a 32bit length followed by the data, padded to 4 bytes.
+ */
+static const size_t s_vtableOffset = sizeof(flatbuffers::uoffset_t);
+static const size_t s_vtableSize = 5 * sizeof(flatbuffers::voffset_t);
+static const size_t s_tableOffset = 16;
+static const size_t s_tableSize = sizeof(flatbuffers::soffset_t) + 3 * sizeof(flatbuffers::uoffset_t);
+
+static size_t vectorSize(size_t size)
+{
+    return sizeof(flatbuffers::uoffset_t) + ((size + 3) & ~size_t(3));
+}
+
+size_t EntityBuffer::entityBufferSize(size_t metadataSize, size_t resourceSize, size_t localSize)
+{
+    return s_tableOffset + s_tableSize + vectorSize(metadataSize) + vectorSize(resourceSize) + vectorSize(localSize);
+}
+
+static uint8_t *writeVector(uint8_t *base, size_t fieldOffset, uint8_t *vector, void const *data, size_t size)
+{
+    flatbuffers::WriteScalar<flatbuffers::uoffset_t>(base + fieldOffset, vector - (base + fieldOffset));
+    flatbuffers::WriteScalar<flatbuffers::uoffset_t>(vector, size);
+    if (size) {
+        memcpy(vector + sizeof(flatbuffers::uoffset_t), data, size);
+    }
+    const size_t paddedSize = vectorSize(size);
+    memset(vector + sizeof(flatbuffers::uoffset_t) + size, 0, paddedSize - sizeof(flatbuffers::uoffset_t) - size);
+    return vector + paddedSize;
+}
+
+void EntityBuffer::assembleEntityBuffer(void *buffer, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize)
+{
+    static_assert(s_vtableOffset + s_vtableSize <= s_tableOffset, "vtable overlaps the table");
+    uint8_t *base = static_cast<uint8_t*>(buffer);
+    memset(base, 0, s_tableOffset);
+    flatbuffers::WriteScalar<flatbuffers::uoffset_t>(base, s_tableOffset);
+
+    //The field offsets are relative to the table, in the order of the fields in entity.fbs
+    uint8_t *vtable = base + s_vtableOffset;
+    flatbuffers::WriteScalar<flatbuffers::voffset_t>(vtable, s_vtableSize);
+    flatbuffers::WriteScalar<flatbuffers::voffset_t>(vtable + 2, s_tableSize);
+    flatbuffers::WriteScalar<flatbuffers::voffset_t>(vtable + 4, 4);
+    flatbuffers::WriteScalar<flatbuffers::voffset_t>(vtable + 6, 8);
+    flatbuffers::WriteScalar<flatbuffers::voffset_t>(vtable + 8, 12);
+
+    uint8_t *table = base + s_tableOffset;
+    flatbuffers::WriteScalar<flatbuffers::soffset_t>(table, s_tableOffset - s_vtableOffset);
+
+    uint8_t *vector = table + s_tableSize;
+    vector = writeVector(base, s_tableOffset + 4, vector, metadataData, metadataSize);
+    vector = writeVector(base, s_tableOffset + 8, vector, resourceData, resourceSize);
+    writeVector(base, s_tableOffset + 12, vector, localData, localSize);
+}
+
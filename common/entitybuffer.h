@@ -8,14 +8,48 @@ class Entity;
 
 class EntityBuffer {
 public:
-    EntityBuffer(void *dataValue, int size);
+    /**
+     * Entities in the entity store have been verified by the pipeline before they were written,
+     * so buffers read from there are trusted and not verified again.
+     *
+     * Set AKONADI2_VERIFY_BUFFERS=1 to verify trusted buffers nonetheless (i.e. while debugging).
+     */
+    enum Trust { Untrusted, Trusted };
+
+    EntityBuffer(void *dataValue, int size, Trust trust = Untrusted);
     const uint8_t *resourceBuffer();
     const uint8_t *metadataBuffer();
     const uint8_t *localBuffer();
     const Entity &entity();
+    bool isValid() const;
+
+    static bool verifyTrustedBuffers();
+
+    //Returns the root of a nested buffer, or 0 if it is missing or fails verification
+    template<typename T>
+    static T const *readBuffer(const flatbuffers::Vector<uint8_t> *data, bool (*verify)(flatbuffers::Verifier &), Trust trust = Untrusted)
+    {
+        if (!data) {
+            return 0;
+        }
+        if (trust == Untrusted || verifyTrustedBuffers()) {
+            flatbuffers::Verifier verifyer(data->Data(), data->size());
+            if (!verify(verifyer)) {
+                return 0;
+            }
+        }
+        return flatbuffers::GetRoot<T>(data->Data());
+    }
 
     static void extractResourceBuffer(void *dataValue, int dataSize, const std::function<void(const uint8_t *, size_t size)> &handler);
     static void assembleEntityBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize);
+    /**
+     * Assembles an entity buffer directly into buffer, without an intermediate FlatBufferBuilder.
+     *
+     * buffer has to be at least entityBufferSize bytes, so it can i.e. be reserved in the storage upfront.
+     */
+    static size_t entityBufferSize(size_t metadataSize, size_t resourceSize, size_t localSize);
+    static void assembleEntityBuffer(void *buffer, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize);
 
 private:
     const Entity *mEntity;
@@ -1,23 +1,249 @@
 #include "index.h"
 #include <QDebug>
+#include <QDateTime>
+#include <cstring>
+#include <algorithm>
 
 Index::Index(const QString &storageRoot, const QString &name, Akonadi2::Storage::AccessMode mode)
-    : mStorage(storageRoot, name, mode, true)
+    : mStorage(storageRoot, name, mode, true),
+    mStorageRoot(storageRoot),
+    mName(name),
+    mMode(mode),
+    mBloomRevision(-1),
+    mBloomFilterChanged(false),
+    mExpectedKeys(0),
+    mFalsePositiveRate(0),
+    mRebuilding(false)
 {
 
 }
 
-void Index::add(const QByteArray &key, const QByteArray &value)
+bool Index::exists() const
+{
+    return mStorage.exists();
+}
+
+void Index::startTransaction()
 {
     mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
-    mStorage.write(key.data(), key.size(), value.data(), value.size());
+}
+
+void Index::commitTransaction()
+{
+    //The filter may only ever know more keys than the index, so it is written first
+    persistBloomFilter();
     mStorage.commitTransaction();
 }
 
+void Index::add(const QByteArray &key, const QByteArray &value)
+{
+    if (mRebuilding) {
+        mRebuildValues << qMakePair(key, value);
+        return;
+    }
+    const bool implicitTransaction = !mStorage.isInTransaction();
+    if (implicitTransaction) {
+        mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
+    }
+    if (mBloomStorage) {
+        ensureBloomFilter();
+        mBloomFilter.add(key);
+        mBloomFilterChanged = true;
+    }
+    mStorage.write(key.data(), key.size(), value.data(), value.size());
+    if (implicitTransaction) {
+        commitTransaction();
+    }
+}
+
+void Index::remove(const QByteArray &key, const QByteArray &value)
+{
+    mStorage.remove(key.data(), key.size(), value.data(), value.size(), [](const Akonadi2::Storage::Error &) {
+        //Not found if the value was already removed
+    });
+}
+
+void Index::replace(const QByteArray &oldKey, const QByteArray &newKey, const QByteArray &value)
+{
+    const bool implicitTransaction = !mStorage.isInTransaction();
+    if (implicitTransaction) {
+        mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
+    }
+    remove(oldKey, value);
+    add(newKey, value);
+    if (implicitTransaction) {
+        commitTransaction();
+    }
+}
+
+void Index::lookupRange(const QByteArray &lower, const QByteArray &upper,
+                        const std::function<bool(const QByteArray &key, const QByteArray &value)> &resultHandler,
+                        const std::function<void(const Error &error)> &errorHandler,
+                        bool descending)
+{
+    mStorage.scanRange(lower, upper, descending, [resultHandler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        return resultHandler(QByteArray(static_cast<char*>(keyPtr), keySize), QByteArray(static_cast<char*>(valuePtr), valueSize));
+    },
+    [errorHandler](const Akonadi2::Storage::Error &error) {
+        qDebug() << "Error while retrieving value" << QString::fromStdString(error.message);
+        errorHandler(Error(error.store, error.code, error.message));
+    }
+    );
+}
+
+static QByteArray encodeUInt64(quint64 value)
+{
+    QByteArray result(8, 0);
+    for (int i = 0; i < 8; i++) {
+        result[i] = static_cast<char>((value >> (8 * (7 - i))) & 0xff);
+    }
+    return result;
+}
+
+//Big endian with the sign bit flipped, so negative values sort before positive ones
+static QByteArray encodeInt64(qint64 value)
+{
+    return encodeUInt64(static_cast<quint64>(value) ^ (quint64(1) << 63));
+}
+
+static QByteArray encodeDouble(double value)
+{
+    quint64 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    //Flip all bits of negative values and only the sign bit of positive ones
+    return encodeUInt64((bits & (quint64(1) << 63)) ? ~bits : bits | (quint64(1) << 63));
+}
+
+QByteArray Index::encodeValue(const QVariant &value, bool last)
+{
+    switch (value.type()) {
+        case QVariant::Invalid:
+            return QByteArray();
+        case QVariant::Bool:
+            return QByteArray(1, value.toBool() ? 1 : 0);
+        case QVariant::Int:
+        case QVariant::LongLong:
+        case QVariant::UInt:
+        case QVariant::ULongLong:
+            return encodeInt64(value.toLongLong());
+        case QVariant::Double:
+            return encodeDouble(value.toDouble());
+        case QVariant::DateTime:
+            return encodeInt64(value.toDateTime().toMSecsSinceEpoch());
+        case QVariant::Date:
+            return encodeInt64(value.toDate().toJulianDay());
+        default:
+            break;
+    }
+    const QByteArray data = value.type() == QVariant::ByteArray ? value.toByteArray() : value.toString().toUtf8();
+    //The last component is stored as is, which keeps single property indexes readable
+    if (last) {
+        return data;
+    }
+    //Otherwise 0 is escaped and the value is terminated by a sequence that sorts before any escaped content
+    QByteArray result;
+    result.reserve(data.size() + 2);
+    for (const char c : data) {
+        result.append(c);
+        if (c == 0) {
+            result.append(static_cast<char>(0xff));
+        }
+    }
+    result.append(static_cast<char>(0));
+    result.append(static_cast<char>(1));
+    return result;
+}
+
+QByteArray Index::encodeKey(const QVariantList &values)
+{
+    QByteArray key;
+    for (int i = 0; i < values.size(); i++) {
+        key += encodeValue(values.at(i), i == values.size() - 1);
+    }
+    return key;
+}
+
+QByteArray Index::prefixUpperBound(const QByteArray &prefix)
+{
+    QByteArray bound = prefix;
+    while (!bound.isEmpty()) {
+        const int last = bound.size() - 1;
+        if (static_cast<unsigned char>(bound.at(last)) != 0xff) {
+            bound[last] = static_cast<char>(static_cast<unsigned char>(bound.at(last)) + 1);
+            return bound;
+        }
+        bound.chop(1);
+    }
+    return bound;
+}
+
+//The buckets of level 0 are an hour wide, each further level doubles the width
+static const qint64 s_intervalBaseWidth = 3600000;
+//The top level holds all intervals that are too long for any other level
+static const int s_intervalTopLevel = 23;
+
+static qint64 floorDiv(qint64 value, qint64 divisor)
+{
+    const qint64 result = value / divisor;
+    return (value % divisor != 0 && value < 0) ? result - 1 : result;
+}
+
+QByteArray Index::intervalKey(qint64 start, qint64 end)
+{
+    int level = 0;
+    while (level < s_intervalTopLevel && floorDiv(end, s_intervalBaseWidth << level) - floorDiv(start, s_intervalBaseWidth << level) > 1) {
+        level++;
+    }
+    return encodeKey(QVariantList() << level << floorDiv(start, s_intervalBaseWidth << level));
+}
+
+QVector<QPair<QByteArray, QByteArray> > Index::intervalRanges(qint64 start, qint64 end)
+{
+    QVector<QPair<QByteArray, QByteArray> > ranges;
+    for (int level = 0; level < s_intervalTopLevel; level++) {
+        const qint64 width = s_intervalBaseWidth << level;
+        const QByteArray prefix = encodeValue(level);
+        //An interval stored in bucket b covers at most the buckets b and b + 1
+        ranges << qMakePair(prefix + encodeValue(floorDiv(start, width) - 1), prefixUpperBound(prefix + encodeValue(floorDiv(end, width))));
+    }
+    const QByteArray top = encodeValue(s_intervalTopLevel);
+    ranges << qMakePair(top, prefixUpperBound(top));
+    return ranges;
+}
+
+QStringList Index::tokenize(const QString &text)
+{
+    QStringList tokens;
+    QString token;
+    for (const QChar c : text) {
+        if (c.isLetterOrNumber()) {
+            token += c.toLower();
+        } else if (!token.isEmpty()) {
+            tokens << token;
+            token.clear();
+        }
+    }
+    if (!token.isEmpty()) {
+        tokens << token;
+    }
+    tokens.removeDuplicates();
+    return tokens;
+}
+
 void Index::lookup(const QByteArray &key, const std::function<void(const QByteArray &value)> &resultHandler,
                                           const std::function<void(const Error &error)> &errorHandler)
 {
-    mStorage.scan(key.data(), key.size(), [this, resultHandler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+    if (!mayContain(key)) {
+        return;
+    }
+    const bool filtered = !mBloomFilter.isNull();
+    bool found = false;
+    mStorage.scan(key.data(), key.size(), [key, resultHandler, &found](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        //The scan starts at the first key that is not smaller than key, which is not necessarily key
+        if (QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize) != key) {
+            return false;
+        }
+        found = true;
         resultHandler(QByteArray(static_cast<char*>(valuePtr), valueSize));
         return true;
     },
@@ -26,5 +252,171 @@ void Index::lookup(const QByteArray &key, const std::function<void(const QByteAr
         errorHandler(Error(error.store, error.code, error.message));
     }
     );
+    if (filtered && !found) {
+        mStatistics.falsePositives++;
+    }
+}
+
+void Index::enableBloomFilter(int expectedKeys, double falsePositiveRate)
+{
+    mExpectedKeys = expectedKeys;
+    mFalsePositiveRate = falsePositiveRate;
+    if (!mBloomStorage) {
+        mBloomStorage = QSharedPointer<Akonadi2::Storage>::create(mStorageRoot, mName + ".bloom", mMode);
+    }
+    ensureBloomFilter();
+}
+
+bool Index::mayContain(const QByteArray &key)
+{
+    if (!mBloomStorage) {
+        return true;
+    }
+    ensureBloomFilter();
+    if (mBloomFilter.isNull()) {
+        return true;
+    }
+    mStatistics.lookups++;
+    if (!mBloomFilter.mayContain(key)) {
+        mStatistics.skipped++;
+        return false;
+    }
+    return true;
+}
+
+Index::BloomFilterStatistics Index::bloomFilterStatistics() const
+{
+    auto statistics = mStatistics;
+    statistics.estimatedFalsePositiveRate = mBloomFilter.estimatedFalsePositiveRate();
+    return statistics;
+}
+
+void Index::loadBloomFilter()
+{
+    //The revision changes whenever the writer persisted its filter
+    //Unsaved additions of the writer must not be replaced
+    if (!mBloomStorage->exists() || mBloomFilterChanged) {
+        return;
+    }
+    const qint64 revision = mBloomStorage->maxRevision();
+    if (revision == mBloomRevision) {
+        return;
+    }
+    mBloomStorage->read(std::string("filter"), [this](void *ptr, int size) -> bool {
+        mBloomFilter = BloomFilter::deserialize(QByteArray(static_cast<char*>(ptr), size));
+        return false;
+    },
+    [](const Akonadi2::Storage::Error &) {
+        //Not found if the filter wasn't written yet
+    });
+    mBloomRevision = revision;
+}
+
+void Index::ensureBloomFilter()
+{
+    loadBloomFilter();
+    //A missing filter, i.e. of an index written before the filter was enabled, is rebuilt from the index.
+    //So is a full one, which also drops the keys that have been removed since.
+    if (mMode == Akonadi2::Storage::ReadWrite && (mBloomFilter.isNull() || mBloomFilter.count() > mBloomFilter.capacity())) {
+        rebuildBloomFilter();
+    }
+}
+
+void Index::rebuildBloomFilter()
+{
+    const auto errorHandler = [](const Akonadi2::Storage::Error &error) {
+        qWarning() << "Error while rebuilding bloom filter" << QString::fromStdString(error.message);
+    };
+    //Every key is visited once per value, so only the first visit of each key counts
+    int keys = 0;
+    QByteArray previous;
+    mStorage.scanRange(QByteArray(), QByteArray(), false, [&keys, &previous](void *keyPtr, int keySize, void *, int) -> bool {
+        const auto key = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        if (!keys || key != previous) {
+            previous = QByteArray(key.constData(), key.size());
+            keys++;
+        }
+        return true;
+    }, errorHandler);
+
+    BloomFilter filter(qMax(mExpectedKeys, 2 * keys), mFalsePositiveRate);
+    previous.clear();
+    bool first = true;
+    mStorage.scanRange(QByteArray(), QByteArray(), false, [&filter, &previous, &first](void *keyPtr, int keySize, void *, int) -> bool {
+        const auto key = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        if (first || key != previous) {
+            previous = QByteArray(key.constData(), key.size());
+            filter.add(previous);
+            first = false;
+        }
+        return true;
+    }, errorHandler);
+    mBloomFilter = filter;
+    mBloomFilterChanged = true;
+    //Otherwise it is written when the transaction is committed
+    if (!mStorage.isInTransaction()) {
+        persistBloomFilter();
+    }
+}
+
+void Index::persistBloomFilter()
+{
+    if (!mBloomStorage || !mBloomFilterChanged) {
+        return;
+    }
+    const auto data = mBloomFilter.serialize();
+    mBloomStorage->startTransaction(Akonadi2::Storage::ReadWrite);
+    const qint64 revision = mBloomStorage->maxRevision() + 1;
+    mBloomStorage->write("filter", 6, data.constData(), data.size());
+    mBloomStorage->setMaxRevision(revision);
+    mBloomStorage->commitTransaction();
+    mBloomRevision = revision;
+    mBloomFilterChanged = false;
 }
 
+void Index::beginRebuild()
+{
+    mRebuilding = true;
+    mRebuildValues.clear();
+}
+
+bool Index::isRebuilding() const
+{
+    return mRebuilding;
+}
+
+void Index::abortRebuild()
+{
+    mRebuilding = false;
+    mRebuildValues.clear();
+}
+
+bool Index::commitRebuild()
+{
+    mRebuilding = false;
+    auto values = mRebuildValues;
+    mRebuildValues.clear();
+    //The storage orders the values of a key like the keys, so sorting the pairs yields the storage order
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
+    if (!mStorage.removeAll()) {
+        qWarning() << "Failed to clear index " << mName;
+        mStorage.abortTransaction();
+        return false;
+    }
+    for (const auto &value : values) {
+        if (!mStorage.append(value.first.constData(), value.first.size(), value.second.constData(), value.second.size())) {
+            qWarning() << "Failed to load index " << mName;
+            mStorage.abortTransaction();
+            return false;
+        }
+    }
+    if (mBloomStorage) {
+        //The keys that are no longer in the index are dropped from the filter as well
+        rebuildBloomFilter();
+    }
+    commitTransaction();
+    return true;
+}
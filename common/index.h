@@ -3,7 +3,13 @@
 #include <string>
 #include <functional>
 #include <QString>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+#include <QPair>
+#include <QSharedPointer>
 #include "storage.h"
+#include "bloomfilter.h"
 
 /**
  * An index for value pairs.
@@ -21,15 +27,92 @@ public:
         int code;
     };
 
+    struct BloomFilterStatistics
+    {
+        BloomFilterStatistics() : lookups(0), skipped(0), falsePositives(0), estimatedFalsePositiveRate(0) {}
+        //Lookups that were checked against the filter
+        qint64 lookups;
+        //Lookups of absent keys that the filter answered without touching the index
+        qint64 skipped;
+        //Lookups of absent keys that the filter let through
+        qint64 falsePositives;
+        double estimatedFalsePositiveRate;
+        double observedFalsePositiveRate() const { return (skipped + falsePositives) ? static_cast<double>(falsePositives) / (skipped + falsePositives) : 0; }
+    };
+
     Index(const QString &storageRoot, const QString &name, Akonadi2::Storage::AccessMode mode = Akonadi2::Storage::ReadOnly);
 
+    //False if the index could not be opened, i.e. because it was not written yet
+    bool exists() const;
+
+    //Writes within a transaction are committed together. Without a transaction every write is committed on its own.
+    void startTransaction();
+    void commitTransaction();
+
     void add(const QByteArray &key, const QByteArray &value);
-    // void remove(const QByteArray &key, const QByteArray &value);
+    //Removes a single value of key
+    void remove(const QByteArray &key, const QByteArray &value);
+    //Moves value from oldKey to newKey, i.e. when the indexed property changed
+    void replace(const QByteArray &oldKey, const QByteArray &newKey, const QByteArray &value);
 
     void lookup(const QByteArray &key, const std::function<void(const QByteArray &value)> &resultHandler,
                                        const std::function<void(const Error &error)> &errorHandler);
 
+    //Collects the values passed to add in memory instead of writing them, until the rebuild is committed.
+    //remove and replace are not supported while rebuilding.
+    void beginRebuild();
+    bool isRebuilding() const;
+    //Replaces the contents of the index with the collected values, which are sorted and bulk loaded in a single transaction
+    bool commitRebuild();
+    //Discards the collected values and keeps the index as it was
+    void abortRebuild();
+
+    //Keeps a Bloom filter of the keys next to the index, so lookups of absent keys don't have to touch the index.
+    //With write access a missing or full filter is rebuilt from the index, otherwise the filter of the writer is used if there is one.
+    void enableBloomFilter(int expectedKeys = 10000, double falsePositiveRate = 0.01);
+    //False if the key is definitely not in the index
+    bool mayContain(const QByteArray &key);
+    BloomFilterStatistics bloomFilterStatistics() const;
+
+    //Walks all keys with lower <= key < upper in index order. Empty bounds are unlimited. Return false from the handler to stop.
+    void lookupRange(const QByteArray &lower, const QByteArray &upper,
+                     const std::function<bool(const QByteArray &key, const QByteArray &value)> &resultHandler,
+                     const std::function<void(const Error &error)> &errorHandler,
+                     bool descending = false);
+
+    //Encodes a property value so the byte order of the encoded values matches the order of the values.
+    //Components that are not last are self-delimiting, so keys of several properties sort by the first property first.
+    static QByteArray encodeValue(const QVariant &value, bool last = true);
+    static QByteArray encodeKey(const QVariantList &values);
+    //The smallest key that is larger than all keys starting with prefix, or an empty key if there is none.
+    static QByteArray prefixUpperBound(const QByteArray &prefix);
+
+    //Interval indexes store an interval of timestamps in msecs in a single bucket, using the smallest level
+    //whose buckets are wide enough so the interval spans at most two of them.
+    static QByteArray intervalKey(qint64 start, qint64 end);
+    //The key ranges that contain all intervals overlapping [start, end]
+    static QVector<QPair<QByteArray, QByteArray> > intervalRanges(qint64 start, qint64 end);
+
+    //The distinct lowercase words of text, as used as keys of full-text indexes
+    static QStringList tokenize(const QString &text);
+
 private:
     Q_DISABLE_COPY(Index);
+    void loadBloomFilter();
+    void ensureBloomFilter();
+    void rebuildBloomFilter();
+    void persistBloomFilter();
     Akonadi2::Storage mStorage;
+    QString mStorageRoot;
+    QString mName;
+    Akonadi2::Storage::AccessMode mMode;
+    QSharedPointer<Akonadi2::Storage> mBloomStorage;
+    BloomFilter mBloomFilter;
+    qint64 mBloomRevision;
+    bool mBloomFilterChanged;
+    int mExpectedKeys;
+    double mFalsePositiveRate;
+    BloomFilterStatistics mStatistics;
+    bool mRebuilding;
+    QVector<QPair<QByteArray, QByteArray> > mRebuildValues;
 };
@@ -2,41 +2,167 @@
 #include "storage.h"
 #include <QDebug>
 
+static const int s_maxBackoffInterval = 60000;
+
+static const int s_messageKeySize = 19;
+
+static QByteArray retryKey(const QByteArray &key)
+{
+    return "__internal_retries_" + key;
+}
+
+//The revisions are zero-padded, so the messages are scanned in the order they were enqueued
+static QByteArray messageKey(qint64 revision)
+{
+    return QString("%1").arg(revision, s_messageKeySize, 10, QLatin1Char('0')).toUtf8();
+}
+
+//Queues written before the keys were padded would otherwise dequeue "10" before "9"
+static void migrateLegacyKeys(Akonadi2::Storage &storage)
+{
+    QVector<QPair<QByteArray, QByteArray> > legacy;
+    storage.scan("", [&legacy](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        if (!Akonadi2::Storage::isInternalKey(keyPtr, keySize) && keySize != s_messageKeySize) {
+            legacy << qMakePair(QByteArray(static_cast<char*>(keyPtr), keySize), QByteArray(static_cast<char*>(valuePtr), valueSize));
+        }
+        return true;
+    });
+    if (legacy.isEmpty()) {
+        return;
+    }
+    qDebug() << "Migrating " << legacy.size() << " queued messages to padded keys";
+    storage.startTransaction(Akonadi2::Storage::ReadWrite);
+    for (const auto &message : legacy) {
+        const auto key = messageKey(message.first.toLongLong());
+        storage.write(key.data(), key.size(), message.second.data(), message.second.size());
+        storage.remove(message.first.data(), message.first.size());
+        const auto oldRetries = retryKey(message.first);
+        storage.read(oldRetries.toStdString(), [&storage, &key](const std::string &value) -> bool {
+            storage.write(retryKey(key).toStdString(), value);
+            return false;
+        },
+        [](const Akonadi2::Storage::Error &) {
+            //Not found if the message didn't fail yet
+        });
+        storage.remove(oldRetries.data(), oldRetries.size(), [](const Akonadi2::Storage::Error &) {});
+    }
+    storage.commitTransaction();
+}
+
 MessageQueue::MessageQueue(const QString &storageRoot, const QString &name)
-    : mStorage(storageRoot, name, Akonadi2::Storage::ReadWrite)
+    : mStorage(storageRoot, name, Akonadi2::Storage::ReadWrite),
+    mDeadLetterQueue(0),
+    mMaxRetries(5),
+    mBackoffInterval(100),
+    mCount(0),
+    mRevision(0),
+    mLowWatermark(0),
+    mHighWatermark(0),
+    mAboveHighWatermark(false),
+    mIndividualRetries(0)
 {
+    mBackoffTimer.setSingleShot(true);
+    QObject::connect(&mBackoffTimer, &QTimer::timeout, this, &MessageQueue::messageReady);
+    migrateLegacyKeys(mStorage);
+    inspect([this](const QByteArray &, void *, int) -> bool {
+        mCount++;
+        return true;
+    });
+    mRevision = mStorage.maxRevision();
+}
+
+void MessageQueue::setDeadLetterQueue(MessageQueue *queue, int maxRetries)
+{
+    mDeadLetterQueue = queue;
+    mMaxRetries = maxRetries;
+}
 
+void MessageQueue::setBackoffInterval(int msecs)
+{
+    mBackoffInterval = msecs;
 }
 
-void MessageQueue::enqueue(void const *msg, size_t size)
+void MessageQueue::setWatermarks(int low, int high)
 {
+    Q_ASSERT(low <= high);
+    mLowWatermark = low;
+    mHighWatermark = high;
+    //The queue may already be over the limit from a previous run
+    mAboveHighWatermark = mHighWatermark > 0 && mCount >= mHighWatermark;
+}
+
+bool MessageQueue::isAboveHighWatermark() const
+{
+    return mAboveHighWatermark;
+}
+
+void MessageQueue::messageAdded()
+{
+    mCount++;
+    if (mHighWatermark > 0 && !mAboveHighWatermark && mCount >= mHighWatermark) {
+        mAboveHighWatermark = true;
+        emit highWatermarkReached();
+    }
+}
+
+void MessageQueue::messageRemoved()
+{
+    mCount = qMax(mCount - 1, 0);
+    if (mAboveHighWatermark && mCount <= mLowWatermark) {
+        mAboveHighWatermark = false;
+        emit lowWatermarkReached();
+    }
+}
+
+qint64 MessageQueue::enqueue(void const *msg, size_t size)
+{
+    //The write transaction also serializes writers in other processes
     mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
     const qint64 revision = mStorage.maxRevision() + 1;
-    const QByteArray key = QString("%1").arg(revision).toUtf8();
+    const QByteArray key = messageKey(revision);
     mStorage.write(key.data(), key.size(), msg, size);
     mStorage.setMaxRevision(revision);
     mStorage.commitTransaction();
+    notifyEnqueued(revision);
+    return revision;
+}
+
+void MessageQueue::notifyEnqueued(qint64 revision)
+{
+    if (revision <= mRevision) {
+        //Already accounted for by an earlier notification
+        return;
+    }
+    for (qint64 r = mRevision; r < revision; r++) {
+        messageAdded();
+    }
+    mRevision = revision;
     emit messageReady();
 }
 
 void MessageQueue::dequeue(const std::function<void(void *ptr, int size, std::function<void(bool success)>)> &resultHandler,
                            const std::function<void(const Error &error)> &errorHandler)
 {
+    if (mBackoffTimer.isActive()) {
+        errorHandler(Error("messagequeue", -2, "Waiting to retry failed message"));
+        return;
+    }
     bool readValue = false;
     mStorage.scan("", 0, [this, resultHandler, &readValue](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
-        const auto key  = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        //The key has to outlive the transaction since the callback may be called asynchronously
+        const auto key = QByteArray(static_cast<char*>(keyPtr), keySize);
         if (Akonadi2::Storage::isInternalKey(key)) {
             return true;
         }
         readValue = true;
         resultHandler(valuePtr, valueSize, [this, key](bool success) {
             if (success) {
-                mStorage.remove(key.data(), key.size());
+                removeMessages(QVector<QByteArray>() << key);
                 if (isEmpty()) {
                     emit this->drained();
                 }
             } else {
-                //TODO re-enqueue?
+                messageFailed(key);
             }
         });
         return false;
@@ -51,6 +177,136 @@ void MessageQueue::dequeue(const std::function<void(void *ptr, int size, std::fu
     }
 }
 
+void MessageQueue::dequeueBatch(int maxBatchSize, const std::function<void(const QVector<QByteArray> &messages, std::function<void(bool success)>)> &resultHandler,
+                                const std::function<void(const Error &error)> &errorHandler,
+                                const std::function<bool(const QByteArray &message)> &isBatchable)
+{
+    if (mBackoffTimer.isActive()) {
+        errorHandler(Error("messagequeue", -2, "Waiting to retry failed message"));
+        return;
+    }
+    //After a failed batch we continue one message at a time until we're past the failed batch
+    const int batchSize = mIndividualRetries > 0 ? 1 : qMax(maxBatchSize, 1);
+    QVector<QByteArray> keys;
+    QVector<QByteArray> messages;
+    mStorage.scan("", 0, [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        if (Akonadi2::Storage::isInternalKey(keyPtr, keySize)) {
+            return true;
+        }
+        //The batch is processed asynchronously, so we have to copy it out of the transaction
+        const QByteArray message(static_cast<char*>(valuePtr), valueSize);
+        const bool batchable = !isBatchable || isBatchable(message);
+        if (!batchable && !keys.isEmpty()) {
+            //Left for the next batch
+            return false;
+        }
+        keys << QByteArray(static_cast<char*>(keyPtr), keySize);
+        messages << message;
+        return batchable && keys.size() < batchSize;
+    },
+    [errorHandler](const Akonadi2::Storage::Error &error) {
+        qDebug() << "Error while retrieving value" << QString::fromStdString(error.message);
+        errorHandler(Error(error.store, error.code, error.message));
+    }
+    );
+    if (keys.isEmpty()) {
+        errorHandler(Error("messagequeue", -1, "No message found"));
+        return;
+    }
+    resultHandler(messages, [this, keys](bool success) {
+        if (success) {
+            removeMessages(keys);
+            if (mIndividualRetries > 0) {
+                mIndividualRetries--;
+            }
+            if (isEmpty()) {
+                emit this->drained();
+            }
+        } else if (keys.size() == 1) {
+            messageFailed(keys.first());
+        } else {
+            qDebug() << "Batch of " << keys.size() << " messages failed, retrying individually";
+            mIndividualRetries = keys.size();
+            //The first message is retried first, so it carries the failure of the batch and its backoff
+            messageFailed(keys.first());
+        }
+    });
+}
+
+void MessageQueue::removeMessages(const QVector<QByteArray> &keys)
+{
+    mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
+    for (const auto &key : keys) {
+        const auto retries = retryKey(key);
+        mStorage.remove(key.data(), key.size());
+        //Only exists if the message failed before
+        mStorage.remove(retries.data(), retries.size(), [](const Akonadi2::Storage::Error &) {});
+    }
+    mStorage.commitTransaction();
+    for (int i = 0; i < keys.size(); i++) {
+        messageRemoved();
+    }
+}
+
+int MessageQueue::retryCount(const QByteArray &key)
+{
+    int count = 0;
+    mStorage.read(retryKey(key).toStdString(), [&count](const std::string &value) -> bool {
+        count = QByteArray::fromStdString(value).toInt();
+        return false;
+    },
+    [](const Akonadi2::Storage::Error &) {
+        //Not found if the message didn't fail yet
+    });
+    return count;
+}
+
+void MessageQueue::messageFailed(const QByteArray &key)
+{
+    //The retry count is persisted so a message that crashes the resource still ends up in the dead letter queue eventually
+    const int retries = retryCount(key) + 1;
+    if (mDeadLetterQueue && retries >= mMaxRetries) {
+        qWarning() << "Message failed" << retries << "times, moving it to the dead letter queue: " << key;
+        moveToDeadLetterQueue(key);
+        return;
+    }
+    mStorage.write(retryKey(key).toStdString(), QByteArray::number(retries).toStdString());
+
+    const int backoff = qMin(mBackoffInterval << qMin(retries - 1, 16), s_maxBackoffInterval);
+    qDebug() << "Message failed, retrying in " << backoff << "ms: " << key;
+    if (backoff > 0) {
+        mBackoffTimer.start(backoff);
+    }
+}
+
+void MessageQueue::moveToDeadLetterQueue(const QByteArray &key)
+{
+    mStorage.read(key.toStdString(), [this](void *ptr, int size) -> bool {
+        mDeadLetterQueue->enqueue(ptr, size);
+        return false;
+    });
+    removeMessages(QVector<QByteArray>() << key);
+    if (mIndividualRetries > 0) {
+        mIndividualRetries--;
+    }
+    if (isEmpty()) {
+        emit drained();
+    } else {
+        emit messageReady();
+    }
+}
+
+void MessageQueue::inspect(const std::function<bool(const QByteArray &key, void *ptr, int size)> &handler)
+{
+    mStorage.scan("", [&handler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        const auto key = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        if (Akonadi2::Storage::isInternalKey(key)) {
+            return true;
+        }
+        return handler(key, valuePtr, valueSize);
+    });
+}
+
 bool MessageQueue::isEmpty()
 {
     int count = 0;
@@ -64,4 +320,3 @@ bool MessageQueue::isEmpty()
     });
     return count == 0;
 }
-
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <QObject>
+#include <QTimer>
 #include <string>
 #include <functional>
 #include <QString>
+#include <QVector>
 #include "storage.h"
 
 /**
  * A persistent FIFO message queue.
+ *
+ * Messages that fail processing stay at the head of the queue and are retried with an exponential backoff.
+ * If a dead letter queue is set, messages that keep failing are eventually moved there so they don't block the queue.
  */
 class MessageQueue : public QObject
 {
@@ -25,18 +30,56 @@ public:
 
     MessageQueue(const QString &storageRoot, const QString &name);
 
-    void enqueue(void const *msg, size_t size);
+    //Messages that failed maxRetries times are moved to the dead letter queue.
+    void setDeadLetterQueue(MessageQueue *queue, int maxRetries = 5);
+    //The delay before the first retry of a failed message. It doubles with every further failure.
+    void setBackoffInterval(int msecs);
+    //highWatermarkReached is emitted once high messages are queued, and lowWatermarkReached once the queue drained to low again.
+    void setWatermarks(int low, int high);
+    bool isAboveHighWatermark() const;
+
+    //Returns the revision of the enqueued message
+    qint64 enqueue(void const *msg, size_t size);
+    //Notifies the queue that another process enqueued messages up to revision
+    void notifyEnqueued(qint64 revision);
     //Dequeue a message. This will return a new message everytime called.
     //Call the result handler with a success response to remove the message from the store.
+    //A failure response leaves the message in the queue, and no message is returned until the backoff interval expired.
     //TODO track processing progress to avoid processing the same message with the same preprocessor twice?
     void dequeue(const std::function<void(void *ptr, int size, std::function<void(bool success)>)> & resultHandler,
               const std::function<void(const Error &error)> &errorHandler);
+    //Dequeue up to maxBatchSize messages at once, which are removed together on success.
+    //If the batch fails the messages are retried one at a time, so only the failing message is retried or moved to the dead letter queue.
+    //Messages for which isBatchable returns false end the batch and are only dequeued on their own.
+    void dequeueBatch(int maxBatchSize, const std::function<void(const QVector<QByteArray> &messages, std::function<void(bool success)>)> &resultHandler,
+              const std::function<void(const Error &error)> &errorHandler,
+              const std::function<bool(const QByteArray &message)> &isBatchable = std::function<bool(const QByteArray &message)>());
+    //Calls the handler for each message in the queue without dequeuing it. Return false from the handler to stop.
+    void inspect(const std::function<bool(const QByteArray &key, void *ptr, int size)> &handler);
     bool isEmpty();
 signals:
     void messageReady();
     void drained();
+    void highWatermarkReached();
+    void lowWatermarkReached();
 
 private:
     Q_DISABLE_COPY(MessageQueue);
+    void messageFailed(const QByteArray &key);
+    void moveToDeadLetterQueue(const QByteArray &key);
+    void removeMessages(const QVector<QByteArray> &keys);
+    int retryCount(const QByteArray &key);
+    void messageAdded();
+    void messageRemoved();
     Akonadi2::Storage mStorage;
+    MessageQueue *mDeadLetterQueue;
+    int mMaxRetries;
+    int mBackoffInterval;
+    QTimer mBackoffTimer;
+    int mCount;
+    qint64 mRevision;
+    int mLowWatermark;
+    int mHighWatermark;
+    bool mAboveHighWatermark;
+    int mIndividualRetries;
 };
@@ -23,63 +23,607 @@
 #include <QByteArray>
 #include <QStandardPaths>
 #include <QVector>
-#include <QUuid>
 #include <QDebug>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QTimer>
+#include <QSet>
+#include <QQueue>
+#include <QMutex>
+#include <QSemaphore>
+#include <limits>
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deleteentity_generated.h"
+#include "domainadaptor.h"
 #include "entitybuffer.h"
+#include "index.h"
+#include "threadboundary.h"
 #include "async/src/async.h"
 
 namespace Akonadi2
 {
 
+//Every this many keys one is sampled to find the partition bounds when rebuilding indexes
+static const int s_partitionSampleInterval = 1000;
+
+class WorkItem : public QRunnable
+{
+public:
+    WorkItem(const std::function<void()> &work)
+        : QRunnable(),
+        mWork(work)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        mWork();
+    }
+
+private:
+    std::function<void()> mWork;
+};
+
+static bool intersects(const QList<QByteArray> &a, const QList<QByteArray> &b)
+{
+    for (const auto &value : a) {
+        if (b.contains(value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//An empty list of read properties means the preprocessor reads the whole entity
+static bool readsAny(const QList<QByteArray> &reads, const QList<QByteArray> &properties)
+{
+    return !properties.isEmpty() && (reads.isEmpty() || intersects(reads, properties));
+}
+
+//A preprocessor depends on all earlier preprocessors it conflicts with, so the result is the same as with sequential execution
+static bool dependsOn(const Preprocessor *preprocessor, const Preprocessor *previous)
+{
+    const auto reads = preprocessor->readProperties();
+    const auto writes = preprocessor->writtenProperties();
+    const auto previousReads = previous->readProperties();
+    const auto previousWrites = previous->writtenProperties();
+    //Preprocessors that don't declare anything are executed in order with all others
+    if ((reads.isEmpty() && writes.isEmpty()) || (previousReads.isEmpty() && previousWrites.isEmpty())) {
+        return true;
+    }
+    return readsAny(reads, previousWrites) || intersects(writes, previousWrites) || readsAny(previousReads, writes);
+}
+
+static QVector<QVector<int> > buildDependencies(const QVector<Preprocessor *> &preprocessors)
+{
+    QVector<QVector<int> > dependencies(preprocessors.size());
+    for (int i = 0; i < preprocessors.size(); i++) {
+        for (int j = 0; j < i; j++) {
+            if (dependsOn(preprocessors.at(i), preprocessors.at(j))) {
+                dependencies[i] << j;
+            }
+        }
+    }
+    return dependencies;
+}
+
+//The result of a concurrent preprocessor that has to be committed on the pipeline thread
+struct PreprocessorResult
+{
+    PipelineState state;
+    Preprocessor *preprocessor;
+    std::function<void()> commit;
+};
+
 class Pipeline::Private
 {
 public:
     Private(const QString &resourceName)
         : storage(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", resourceName, Storage::ReadWrite),
-          stepScheduled(false)
+          progressStorage(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", resourceName + ".progress", Storage::ReadWrite),
+          garbageStorage(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", resourceName + ".tombstones", Storage::ReadWrite),
+          oldEntityStorage(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", resourceName + ".oldentities", Storage::ReadWrite),
+          resourceName(resourceName),
+          activePipelines(0),
+          maxActivePipelines(0),
+          stepsPerIteration(100),
+          stepScheduled(false),
+          garbageCollectionBatchSize(1000),
+          rebuildingIndexes(false)
     {
+        garbageCollectionTimer.setSingleShot(true);
+        garbageCollectionTimer.setInterval(1000);
+    }
+
+    QHash<QString, PreprocessorGraph> &graphs(Pipeline::Type type)
+    {
+        switch (type) {
+            case Pipeline::NewPipeline:
+                return newPipeline;
+            case Pipeline::ModifiedPipeline:
+                return modifiedPipeline;
+            case Pipeline::DeletedPipeline:
+                return deletedPipeline;
+            default:
+                break;
+        }
+        return nullPipeline;
     }
 
     Storage storage;
-    QHash<QString, QVector<Preprocessor *> > nullPipeline;
-    QHash<QString, QVector<Preprocessor *> > newPipeline;
-    QHash<QString, QVector<Preprocessor *> > modifiedPipeline;
-    QHash<QString, QVector<Preprocessor *> > deletedPipeline;
-    QVector<PipelineState> activePipelines;
+    //Reused for every written entity to avoid reallocating
+    flatbuffers::FlatBufferBuilder metadataFbb;
+    //Contains an entry for every entity with outstanding preprocessors, so processing can be resumed after a crash.
+    //The value is the pipeline type and entity type, followed by the ids of the completed preprocessors.
+    Storage progressStorage;
+    //Progress that is not yet written to the progress storage
+    QHash<QByteArray, QByteArray> pendingProgress;
+    QVector<QByteArray> completedPipelines;
+    //Contains the previous revision of every entity with outstanding modified preprocessors,
+    //so a resumed pipeline can still remove the index entries of the old values.
+    Storage oldEntityStorage;
+    QVector<QByteArray> completedModifications;
+    //Contains the key and entity type of every tombstone that still has to be collected
+    Storage garbageStorage;
+    QTimer garbageCollectionTimer;
+    int garbageCollectionBatchSize;
+    //The tombstones of the current batch whose deleted pipeline is still running
+    QSet<QByteArray> collecting;
+    //The tombstones that can be removed from the storage
+    QVector<QByteArray> collectedGarbage;
+    QString resourceName;
+    QHash<QString, DomainTypeAdaptorFactoryInterface::Ptr> adaptorFactories;
+    QHash<QString, QSharedPointer<Index> > indexes;
+    QVector<PreprocessorResult> pendingResults;
+    QHash<QString, PreprocessorGraph> nullPipeline;
+    QHash<QString, PreprocessorGraph> newPipeline;
+    QHash<QString, PreprocessorGraph> modifiedPipeline;
+    QHash<QString, PreprocessorGraph> deletedPipeline;
+    //The number of pipelines that didn't complete yet. The states are kept alive by the ready queue or their running preprocessors.
+    int activePipelines;
+    int maxActivePipelines;
+    //The pipelines that were started beyond the limit, they are scheduled once others complete
+    QQueue<PipelineState> waitingPipelines;
+    //The keys of the entities with an active pipeline, and the modifications waiting for it to complete
+    QSet<QByteArray> activeKeys;
+    QHash<QByteArray, QList<std::function<void()> > > deferredModifications;
+    //The pipelines that can execute further preprocessors, in the order they became ready
+    QQueue<PipelineState> readyQueue;
+    int stepsPerIteration;
     bool stepScheduled;
+    //Executes concurrent preprocessors, the results are passed back to the pipeline thread via the thread boundary
+    QThreadPool threadPool;
+    async::ThreadBoundary threadBoundary;
+    //Set while the writes of rebuildIndexes are collected
+    bool rebuildingIndexes;
 };
 
 Pipeline::Pipeline(const QString &resourceName, QObject *parent)
     : QObject(parent),
       d(new Private(resourceName))
 {
+    connect(&d->garbageCollectionTimer, &QTimer::timeout, this, &Pipeline::collectGarbage);
 }
 
 Pipeline::~Pipeline()
 {
+    d->threadPool.waitForDone();
+    flushProgress();
     delete d;
 }
 
 void Pipeline::setPreprocessors(const QString &entityType, Type pipelineType, const QVector<Preprocessor *> &preprocessors)
 {
+    PreprocessorGraph graph;
+    graph.preprocessors = preprocessors;
+    graph.dependencies = buildDependencies(preprocessors);
     switch (pipelineType) {
         case NewPipeline:
-            d->newPipeline[entityType] = preprocessors;
-            break;
         case ModifiedPipeline:
-            d->modifiedPipeline[entityType] = preprocessors;
-            break;
         case DeletedPipeline:
-            d->deletedPipeline[entityType] = preprocessors;
+            d->graphs(pipelineType)[entityType] = graph;
             break;
         default:
             break;
     };
 }
 
+void Pipeline::setStepsPerIteration(int steps)
+{
+    d->stepsPerIteration = qMax(steps, 1);
+}
+
+Index &Pipeline::index(const QString &name)
+{
+    auto it = d->indexes.find(name);
+    if (it == d->indexes.end()) {
+        it = d->indexes.insert(name, QSharedPointer<Index>::create(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", d->resourceName + ".index." + name, Storage::ReadWrite));
+    }
+    if (d->rebuildingIndexes && !(*it)->isRebuilding()) {
+        (*it)->beginRebuild();
+    }
+    return **it;
+}
+
+void Pipeline::setMaxActivePipelines(int max)
+{
+    d->maxActivePipelines = qMax(max, 0);
+}
+
+int Pipeline::availableCapacity() const
+{
+    if (d->maxActivePipelines <= 0) {
+        return std::numeric_limits<int>::max();
+    }
+    return qMax(d->maxActivePipelines - d->activePipelines, 0);
+}
+
+void Pipeline::setGarbageCollection(int msecs, int batchSize)
+{
+    d->garbageCollectionTimer.setInterval(msecs);
+    d->garbageCollectionBatchSize = qMax(batchSize, 1);
+}
+
+void Pipeline::setAdaptorFactory(const QString &entityType, const DomainTypeAdaptorFactoryInterface::Ptr &factory)
+{
+    d->adaptorFactories.insert(entityType, factory);
+}
+
+//Writes the entity with a new metadata buffer
+bool Pipeline::storeEntity(const QByteArray &key, qint64 revision, const Akonadi2::Entity &entity, bool deleted)
+{
+    auto &metadataFbb = d->metadataFbb;
+    metadataFbb.Clear();
+    auto metadataBuilder = Akonadi2::MetadataBuilder(metadataFbb);
+    metadataBuilder.add_revision(revision);
+    metadataBuilder.add_processed(false);
+    if (deleted) {
+        metadataBuilder.add_deleted(true);
+    }
+    auto metadataBuffer = metadataBuilder.Finish();
+    Akonadi2::FinishMetadataBuffer(metadataFbb, metadataBuffer);
+    //TODO we should reserve some space in metadata for in-place updates
+
+    //The entity is assembled directly in the space reserved in the storage, so the payload is only copied once
+    const auto resource = entity.resource();
+    const auto local = entity.local();
+    const size_t resourceSize = resource ? resource->size() : 0;
+    const size_t localSize = local ? local->size() : 0;
+    const size_t entitySize = EntityBuffer::entityBufferSize(metadataFbb.GetSize(), resourceSize, localSize);
+    return storage().write(key.data(), key.size(), entitySize, [&](void *buffer) {
+        EntityBuffer::assembleEntityBuffer(buffer, metadataFbb.GetBufferPointer(), metadataFbb.GetSize(), resource ? resource->Data() : 0, resourceSize, local ? local->Data() : 0, localSize);
+    });
+}
+
+bool Pipeline::verifyEntity(const QString &entityType, const void *data, size_t size)
+{
+    flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(data), size);
+    if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
+        qWarning() << "invalid buffer, not an entity buffer";
+        return false;
+    }
+    //This is the only place where entities enter the storage, readers don't verify them again
+    const auto factory = d->adaptorFactories.value(entityType);
+    if (!factory) {
+        qWarning() << "No adaptor factory for entity type " << entityType;
+        return true;
+    }
+    if (!factory->verifyBuffers(*Akonadi2::GetEntity(data))) {
+        qWarning() << "invalid buffer, the entity buffers failed verification";
+        return false;
+    }
+    return true;
+}
+
+static bool isTombstone(const QByteArray &entity)
+{
+    EntityBuffer buffer(const_cast<char *>(entity.constData()), entity.size(), EntityBuffer::Trusted);
+    if (!buffer.isValid()) {
+        return false;
+    }
+    const auto metadata = EntityBuffer::readBuffer<Akonadi2::Metadata>(buffer.entity().metadata(), Akonadi2::VerifyMetadataBuffer, EntityBuffer::Trusted);
+    return metadata && metadata->deleted();
+}
+
+static QByteArray progressValue(Pipeline::Type type, const QString &entityType, const QStringList &processed)
+{
+    QByteArray value = QByteArray::number(type) + ' ' + entityType.toUtf8();
+    for (const auto &id : processed) {
+        value += '\n' + id.toUtf8();
+    }
+    return value;
+}
+
+bool Pipeline::isProcessing() const
+{
+    return d->activePipelines > 0;
+}
+
+void Pipeline::startPipeline(const PipelineState &state)
+{
+    d->activePipelines++;
+    //The records are kept per entity, which is fine since an entity only has one active pipeline at a time.
+    //A pipeline that completed before must not remove the records of this one on the next flush though.
+    Q_ASSERT(!d->activeKeys.contains(state.key()));
+    d->activeKeys.insert(state.key());
+    d->completedPipelines.removeAll(state.key());
+    d->completedModifications.removeAll(state.key());
+    if (d->maxActivePipelines > 0 && d->activePipelines > d->maxActivePipelines) {
+        d->waitingPipelines.enqueue(state);
+        return;
+    }
+    scheduleState(state);
+}
+
+void Pipeline::scheduleState(const PipelineState &state)
+{
+    d->readyQueue.enqueue(state);
+    scheduleStep();
+}
+
+//Splits the keys of the storage into up to count partitions of about the same size.
+//The bounds are sampled from the stored keys, since stores written before binary keys only contain printable keys.
+static QVector<QPair<QByteArray, QByteArray> > keyPartitions(Storage &storage, int count)
+{
+    QVector<QByteArray> samples;
+    int keys = 0;
+    storage.scanRange(QByteArray(), QByteArray(), false, [&samples, &keys](void *keyPtr, int keySize, void *, int) -> bool {
+        if (keys++ % s_partitionSampleInterval == 0) {
+            samples << QByteArray(static_cast<char*>(keyPtr), keySize);
+        }
+        return true;
+    }, Storage::basicErrorHandler());
+
+    QVector<QPair<QByteArray, QByteArray> > partitions;
+    QByteArray lower;
+    for (int i = 1; i < count; i++) {
+        const auto bound = samples.value(i * samples.size() / count);
+        if (bound.isEmpty() || bound <= lower) {
+            continue;
+        }
+        partitions << qMakePair(lower, bound);
+        lower = bound;
+    }
+    partitions << qMakePair(lower, QByteArray());
+    return partitions;
+}
+
+bool Pipeline::rebuildIndexes(const QString &entityType, const QStringList &ids, int partitions)
+{
+    const auto graph = d->newPipeline.value(entityType);
+    QVector<ConcurrentPreprocessor*> preprocessors;
+    for (const auto preprocessor : graph.preprocessors) {
+        if (!ids.isEmpty() && !ids.contains(preprocessor->id())) {
+            continue;
+        }
+        auto concurrent = dynamic_cast<ConcurrentPreprocessor*>(preprocessor);
+        if (!concurrent) {
+            qWarning() << "Pipeline: can't rebuild the index of " << preprocessor->id() << ", it is not a concurrent preprocessor";
+            continue;
+        }
+        preprocessors << concurrent;
+    }
+    if (preprocessors.isEmpty()) {
+        qWarning() << "Pipeline: no preprocessors to rebuild indexes for " << entityType;
+        return false;
+    }
+
+    //Each partition is read with a storage of its own, since the read transaction is bound to the thread
+    const auto ranges = keyPartitions(d->storage, partitions > 0 ? partitions : 4 * qMax(d->threadPool.maxThreadCount(), 1));
+    QVector<QSharedPointer<Storage> > storages;
+    for (int i = 0; i < ranges.size(); i++) {
+        storages << QSharedPointer<Storage>::create(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", d->resourceName, Storage::ReadOnly);
+    }
+
+    //The index writes of a partition are handed to this thread as soon as the partition is done
+    QMutex mutex;
+    QSemaphore completed;
+    QQueue<QVector<std::function<void()> > > results;
+    bool failed = false;
+    for (int i = 0; i < ranges.size(); i++) {
+        const auto range = ranges.at(i);
+        const auto storage = storages.at(i);
+        d->threadPool.start(new WorkItem([range, storage, &preprocessors, &mutex, &completed, &results, &failed]() {
+            QVector<std::function<void()> > writes;
+            bool error = false;
+            storage->scanRange(range.first, range.second, false, [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+                if (Storage::isInternalKey(keyPtr, keySize)) {
+                    return true;
+                }
+                //Tombstones are indexed as well, their index values are only removed once they are collected
+                EntityBuffer buffer(valuePtr, valueSize, EntityBuffer::Trusted);
+                if (!buffer.isValid()) {
+                    qWarning() << "Pipeline: skipping invalid entity " << Storage::printableKey(QByteArray(static_cast<char*>(keyPtr), keySize));
+                    return true;
+                }
+                const QByteArray key(static_cast<char*>(keyPtr), keySize);
+                for (const auto preprocessor : preprocessors) {
+                    const auto write = preprocessor->processConcurrently(key, buffer.entity());
+                    if (write) {
+                        writes << write;
+                    }
+                }
+                return true;
+            },
+            [&error](const Storage::Error &e) {
+                qWarning() << "Pipeline: error while reading entities " << QString::fromStdString(e.message);
+                error = true;
+            });
+            QMutexLocker locker(&mutex);
+            results.enqueue(writes);
+            failed |= error;
+            completed.release();
+        }));
+    }
+
+    //The declared indexes are replaced even if no entity has a value for them anymore
+    for (const auto preprocessor : preprocessors) {
+        for (const auto &name : preprocessor->writtenIndexes()) {
+            index(name).beginRebuild();
+        }
+    }
+    //Index::add only collects the values while the indexes are rebuilt
+    d->rebuildingIndexes = true;
+    for (int i = 0; i < ranges.size(); i++) {
+        completed.acquire();
+        QVector<std::function<void()> > writes;
+        {
+            QMutexLocker locker(&mutex);
+            writes = results.dequeue();
+        }
+        for (const auto &write : writes) {
+            write();
+        }
+    }
+    d->rebuildingIndexes = false;
+
+    bool success = !failed;
+    for (auto it = d->indexes.constBegin(); it != d->indexes.constEnd(); ++it) {
+        if (!it.value()->isRebuilding()) {
+            continue;
+        }
+        //Indexes are not replaced with the values of a partial scan
+        if (failed) {
+            it.value()->abortRebuild();
+            continue;
+        }
+        qDebug() << "Pipeline: loading index " << it.key();
+        success &= it.value()->commitRebuild();
+    }
+    return success;
+}
+
+//Moves the values of printable entity keys to the binary form of the key, returns the number of moved values or -1 on failure
+static int migrateLegacyKeys(Storage &storage)
+{
+    QList<QByteArray> legacyKeys;
+    storage.scan("", [&legacyKeys](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        const QByteArray key(static_cast<char*>(keyPtr), keySize);
+        if (!Storage::isInternalKey(key) && Storage::entityKey(key) != key) {
+            legacyKeys << key;
+        }
+        return true;
+    });
+
+    //The transactions are kept small, every key is moved within one of them
+    static const int batchSize = 1000;
+    int migrated = 0;
+    bool failed = false;
+    for (int i = 0; i < legacyKeys.size() && !failed; i++) {
+        if (i % batchSize == 0) {
+            storage.startTransaction(Storage::ReadWrite);
+        }
+        const auto &legacyKey = legacyKeys.at(i);
+        const auto key = Storage::entityKey(legacyKey);
+        bool exists = false;
+        storage.read(key.toStdString(), [&exists](void *, int) -> bool {
+            exists = true;
+            return false;
+        },
+        [](const Storage::Error &) {
+            //Not found, as expected
+        });
+        if (exists) {
+            qWarning() << "Pipeline: not migrating " << legacyKey << ", the entity is already stored with its binary key";
+        } else {
+            //The value is copied, since writing to the store invalidates the pointers into it
+            QByteArray value;
+            storage.read(legacyKey.toStdString(), [&value](void *valuePtr, int valueSize) -> bool {
+                value = QByteArray(static_cast<char*>(valuePtr), valueSize);
+                return false;
+            },
+            [&failed](const Storage::Error &error) {
+                qWarning() << "Pipeline: failed to read " << QString::fromStdString(error.message);
+                failed = true;
+            });
+            if (!failed && storage.write(key.constData(), key.size(), value.constData(), value.size())) {
+                storage.remove(legacyKey.constData(), legacyKey.size());
+                migrated++;
+            } else {
+                failed = true;
+            }
+        }
+        if (failed) {
+            storage.abortTransaction();
+        } else if (i % batchSize == batchSize - 1 || i == legacyKeys.size() - 1) {
+            failed = !storage.commitTransaction();
+        }
+    }
+    return failed ? -1 : migrated;
+}
+
+int Pipeline::migrateEntityKeys()
+{
+    const int migrated = migrateLegacyKeys(storage());
+    if (migrated < 0) {
+        return -1;
+    }
+    //The records of interrupted pipelines and pending tombstones refer to the entities by key as well
+    for (const auto other : {&d->progressStorage, &d->garbageStorage, &d->oldEntityStorage}) {
+        if (migrateLegacyKeys(*other) < 0) {
+            return -1;
+        }
+    }
+    qDebug() << "Pipeline: migrated " << migrated << " entities to binary keys";
+    return migrated;
+}
+
+void Pipeline::resumePipelines()
+{
+    QVector<QPair<QByteArray, QByteArray> > entries;
+    d->progressStorage.scan("", [&entries](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        if (Storage::isInternalKey(keyPtr, keySize)) {
+            return true;
+        }
+        entries << qMakePair(QByteArray(static_cast<char*>(keyPtr), keySize), QByteArray(static_cast<char*>(valuePtr), valueSize));
+        return true;
+    });
+    for (const auto &entry : entries) {
+        const auto &key = entry.first;
+        bool exists = false;
+        d->storage.scan(key.toStdString(), [&exists](void *, int, void *, int) -> bool {
+            exists = true;
+            return false;
+        });
+        //The entity was never committed, the command is still in the queue
+        if (!exists) {
+            d->progressStorage.remove(key.data(), key.size());
+            d->oldEntityStorage.remove(key.data(), key.size(), [](const Storage::Error &) {});
+            continue;
+        }
+        auto lines = entry.second.split('\n');
+        const auto header = lines.takeFirst();
+        const int separator = header.indexOf(' ');
+        const Type type = static_cast<Type>(header.left(separator).toInt());
+        const QString entityType = QString::fromUtf8(header.mid(separator + 1));
+        QStringList processed;
+        for (const auto &line : lines) {
+            processed << QString::fromUtf8(line);
+        }
+        qDebug() << "Pipeline: Resuming processing of " << Storage::printableKey(key) << ", already processed: " << processed;
+        if (type == DeletedPipeline) {
+            d->collecting.insert(key);
+        }
+        PipelineState state(this, type, entityType, key, d->graphs(type)[entityType], [this]() {
+            emit revisionUpdated();
+        });
+        if (type == ModifiedPipeline) {
+            //The changed properties are not recorded, so all outstanding preprocessors run
+            d->oldEntityStorage.scan(key.toStdString(), [&state](void *, int, void *valuePtr, int valueSize) -> bool {
+                state.setOldEntity(QByteArray(static_cast<char*>(valuePtr), valueSize));
+                return false;
+            });
+        }
+        state.skipProcessed(processed);
+        startPipeline(state);
+    }
+    //Tombstones left over from the last run
+    d->garbageCollectionTimer.start();
+}
+
 Storage &Pipeline::storage() const
 {
     return d->storage;
@@ -95,75 +639,375 @@ void Pipeline::null()
 
 Async::Job<void> Pipeline::newEntity(void const *command, size_t size)
 {
-    qDebug() << "Pipeline: New Entity";
+    //The command is only processed once the job is executed
+    return newEntities(QVector<QByteArray>() << QByteArray(static_cast<const char *>(command), size));
+}
+
+Async::Job<void> Pipeline::newEntities(const QVector<QByteArray> &commands)
+{
+    return Async::start<void>([this, commands](Async::Future<void> &future) {
+        qDebug() << "Pipeline: New Entities: " << commands.size();
+        //The whole batch is written in a single transaction
+        storage().startTransaction(Storage::ReadWrite);
+        qint64 revision = storage().maxRevision();
+        QVector<PipelineState> states;
+        auto pending = QSharedPointer<int>::create(commands.size());
+        for (const auto &command : commands) {
+            revision++;
+            QByteArray key;
+            QString entityType;
+            if (!storeNewEntity(command.constData(), command.size(), revision, key, entityType)) {
+                storage().abortTransaction();
+                future.setError(1, "Invalid create entity command");
+                return;
+            }
+            states << PipelineState(this, NewPipeline, entityType, key, d->newPipeline[entityType], [this, pending]() {
+                (*pending)--;
+                if (*pending == 0) {
+                    emit revisionUpdated();
+                }
+            });
+        }
+        storage().setMaxRevision(revision);
+
+        //The progress entries have to be committed before the entities, so every committed entity is guaranteed to be processed
+        d->progressStorage.startTransaction(Storage::ReadWrite);
+        for (const auto &state : states) {
+            const auto value = progressValue(NewPipeline, state.entityType(), QStringList());
+            d->progressStorage.write(state.key().constData(), state.key().size(), value.constData(), value.size());
+        }
+        d->progressStorage.commitTransaction();
+        storage().commitTransaction();
+        qDebug() << "Pipeline: wrote entities up to revision: " << revision;
 
-    //TODO toRFC4122 would probably be more efficient, but results in non-printable keys.
-    const auto key = QUuid::createUuid().toString().toUtf8();
+        //The commands are done once the entities are stored, the preprocessors are resumed after a crash
+        for (const auto &state : states) {
+            startPipeline(state);
+        }
+        future.setFinished();
+    });
+}
 
-    const qint64 newRevision = storage().maxRevision() + 1;
+bool Pipeline::storeNewEntity(void const *command, size_t size, qint64 revision, QByteArray &key, QString &entityType)
+{
+    key = Storage::createEntityKey();
 
     {
         flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(command), size);
         if (!Akonadi2::Commands::VerifyCreateEntityBuffer(verifyer)) {
             qWarning() << "invalid buffer, not a create entity buffer";
-            return Async::error<void>();
+            return false;
         }
     }
     auto createEntity = Akonadi2::Commands::GetCreateEntity(command);
 
     //TODO rename createEntitiy->domainType to bufferType
-    const QString entityType = QString::fromUtf8(reinterpret_cast<char const*>(createEntity->domainType()->Data()), createEntity->domainType()->size());
-    {
-        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(createEntity->delta()->Data()), createEntity->delta()->size());
-        if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
-            qWarning() << "invalid buffer, not an entity buffer";
-            return Async::error<void>();
-        }
+    entityType = QString::fromUtf8(reinterpret_cast<char const*>(createEntity->domainType()->Data()), createEntity->domainType()->size());
+    if (!verifyEntity(entityType, createEntity->delta()->Data(), createEntity->delta()->size())) {
+        return false;
     }
-    auto entity = Akonadi2::GetEntity(createEntity->delta()->Data());
+    return storeEntity(key, revision, *Akonadi2::GetEntity(createEntity->delta()->Data()));
+}
 
-    //Add metadata buffer
-    flatbuffers::FlatBufferBuilder metadataFbb;
-    auto metadataBuilder = Akonadi2::MetadataBuilder(metadataFbb);
-    metadataBuilder.add_revision(newRevision);
-    metadataBuilder.add_processed(false);
-    auto metadataBuffer = metadataBuilder.Finish();
-    Akonadi2::FinishMetadataBuffer(metadataFbb, metadataBuffer);
-    //TODO we should reserve some space in metadata for in-place updates
+Async::Job<void> Pipeline::modifiedEntity(void const *command, size_t size)
+{
+    //The command is only processed once the job is executed
+    const QByteArray data(static_cast<const char *>(command), size);
+    return Async::start<void>([this, data](Async::Future<void> &future) {
+        {
+            flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+            if (!Akonadi2::VerifyModifyEntityBuffer(verifyer)) {
+                qWarning() << "invalid buffer, not a modify entity buffer";
+                future.setError(1, "Invalid modify entity command");
+                return;
+            }
+        }
+        auto modifyEntity = Akonadi2::GetModifyEntity(data.constData());
+        if (!modifyEntity->domainType() || !modifyEntity->entityId() || !modifyEntity->delta()) {
+            future.setError(1, "Incomplete modify entity command");
+            return;
+        }
+        const QString entityType = QString::fromUtf8(modifyEntity->domainType()->c_str());
+        const QByteArray key = Storage::entityKey(QByteArray(modifyEntity->entityId()->c_str()));
+        const auto factory = d->adaptorFactories.value(entityType);
+        if (!factory) {
+            qWarning() << "No adaptor factory for entity type " << entityType;
+            future.setError(1, "Unknown entity type");
+            return;
+        }
+        if (!verifyEntity(entityType, modifyEntity->delta()->Data(), modifyEntity->delta()->size())) {
+            future.setError(1, "Invalid modify entity command");
+            return;
+        }
+        //Only one pipeline per entity runs at a time, so the preprocessor results are committed in revision order
+        const std::function<void()> modify = [this, data, key, entityType, factory, &future]() {
+            auto modifyEntity = Akonadi2::GetModifyEntity(data.constData());
 
-    flatbuffers::FlatBufferBuilder fbb;
-    EntityBuffer::assembleEntityBuffer(fbb, metadataFbb.GetBufferPointer(), metadataFbb.GetSize(), entity->resource()->Data(), entity->resource()->size(), entity->local()->Data(), entity->local()->size());
+            storage().startTransaction(Storage::ReadWrite);
+            //The old entity is kept so preprocessors can update incrementally
+            QByteArray oldEntity;
+            storage().scan(key.toStdString(), [&oldEntity](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+                oldEntity = QByteArray(static_cast<char*>(dataValue), dataSize);
+                return false;
+            });
+            if (oldEntity.isEmpty() || isTombstone(oldEntity)) {
+                storage().abortTransaction();
+                //i.e. the client modified an entity that was deleted meanwhile, retrying won't help
+                qWarning() << "Dropping the modification of a missing entity: " << Storage::printableKey(key);
+                future.setFinished();
+                return;
+            }
 
-    storage().write(key.data(), key.size(), fbb.GetBufferPointer(), fbb.GetSize());
-    storage().setMaxRevision(newRevision);
-    qDebug() << "Pipeline: wrote entity: "<< newRevision;
+            //Merge the changed properties and deletions into the current values
+            const auto current = factory->createAdaptor(*Akonadi2::GetEntity(oldEntity.constData()));
+            const auto delta = factory->createAdaptor(*Akonadi2::GetEntity(modifyEntity->delta()->Data()));
+            auto merged = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create(*current);
+            QList<QByteArray> changedProperties;
+            for (const auto &property : delta->availableProperties()) {
+                const auto value = delta->getProperty(property);
+                if (value.isValid()) {
+                    merged->setProperty(property, value);
+                    changedProperties << property.toUtf8();
+                }
+            }
+            if (auto deletions = modifyEntity->deletions()) {
+                for (auto it = deletions->begin(); it != deletions->end(); ++it) {
+                    const QString property = QString::fromUtf8(it->c_str());
+                    merged->setProperty(property, QVariant());
+                    changedProperties << property.toUtf8();
+                }
+            }
 
-    return Async::start<void>([this, key, entityType](Async::Future<void> &future) {
-        PipelineState state(this, NewPipeline, key, d->newPipeline[entityType], [&future]() {
+            const qint64 revision = storage().maxRevision() + 1;
+            flatbuffers::FlatBufferBuilder fbb;
+            //The factory of the entity type knows its buffers, the domain object only carries the merged values
+            factory->createBuffer(Akonadi2::Domain::AkonadiDomainType(d->resourceName, QString::fromUtf8(Storage::printableKey(key)), revision, merged), fbb);
+            if (!storeEntity(key, revision, *Akonadi2::GetEntity(fbb.GetBufferPointer()))) {
+                storage().abortTransaction();
+                qWarning() << "Failed to store the modified entity: " << Storage::printableKey(key);
+                future.setError(1, "Failed to store entity");
+                return;
+            }
+            storage().setMaxRevision(revision);
+
+            //Like the progress, the old entity is recorded before the entity is committed
+            d->oldEntityStorage.write(key.constData(), key.size(), oldEntity.constData(), oldEntity.size());
+            const auto progress = progressValue(ModifiedPipeline, entityType, QStringList());
+            d->progressStorage.write(key.constData(), key.size(), progress.constData(), progress.size());
+            storage().commitTransaction();
+            qDebug() << "Pipeline: modified entity " << Storage::printableKey(key) << " in revision " << revision;
+
+            PipelineState state(this, ModifiedPipeline, entityType, key, d->modifiedPipeline[entityType], [this]() {
+                emit revisionUpdated();
+            });
+            state.setOldEntity(oldEntity);
+            //Preprocessors that only depend on unchanged properties are skipped
+            state.setChangedProperties(changedProperties);
+            startPipeline(state);
             future.setFinished();
+        };
+        if (d->activeKeys.contains(key)) {
+            qDebug() << "Pipeline: deferring the modification of " << Storage::printableKey(key) << " until its running pipeline completed";
+            d->deferredModifications[key] << modify;
+            return;
+        }
+        modify();
+    });
+}
+
+Async::Job<void> Pipeline::deletedEntity(void const *command, size_t size)
+{
+    //The command is only processed once the job is executed
+    const QByteArray data(static_cast<const char *>(command), size);
+    return Async::start<void>([this, data](Async::Future<void> &future) {
+        {
+            flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+            if (!Akonadi2::VerifyDeleteEntityBuffer(verifyer)) {
+                qWarning() << "invalid buffer, not a delete entity buffer";
+                future.setError(1, "Invalid delete entity command");
+                return;
+            }
+        }
+        auto deleteEntity = Akonadi2::GetDeleteEntity(data.constData());
+        if (!deleteEntity->domainType() || !deleteEntity->entityId()) {
+            future.setError(1, "Incomplete delete entity command");
+            return;
+        }
+        const QByteArray entityType(deleteEntity->domainType()->c_str());
+        const QByteArray key = Storage::entityKey(QByteArray(deleteEntity->entityId()->c_str()));
+
+        storage().startTransaction(Storage::ReadWrite);
+        QByteArray entity;
+        storage().scan(key.toStdString(), [&entity](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            entity = QByteArray(static_cast<char*>(dataValue), dataSize);
+            return false;
         });
-        d->activePipelines << state;
-        state.step();
+        if (entity.isEmpty() || isTombstone(entity)) {
+            storage().abortTransaction();
+            //i.e. the entity was deleted already, retrying won't help
+            qWarning() << "Dropping the deletion of a missing entity: " << Storage::printableKey(key);
+            future.setFinished();
+            return;
+        }
+
+        const qint64 revision = storage().maxRevision() + 1;
+        //The tombstone keeps the payload until it is collected, so the deleted pipeline can still read the removed values
+        if (!storeEntity(key, revision, *Akonadi2::GetEntity(entity.constData()), true)) {
+            storage().abortTransaction();
+            qWarning() << "Failed to store the tombstone: " << Storage::printableKey(key);
+            future.setError(1, "Failed to store entity");
+            return;
+        }
+        storage().setMaxRevision(revision);
+        //The tombstone is recorded before the entity is committed, so it is guaranteed to be collected
+        d->garbageStorage.write(key.constData(), key.size(), entityType.constData(), entityType.size());
+        storage().commitTransaction();
+        qDebug() << "Pipeline: deleted entity " << Storage::printableKey(key) << " in revision " << revision;
+
+        emit revisionUpdated();
+        //Consecutive deletions are collected together
+        if (!d->garbageCollectionTimer.isActive()) {
+            d->garbageCollectionTimer.start();
+        }
+        future.setFinished();
     });
 }
 
-void Pipeline::modifiedEntity(const QString &entityType, const QByteArray &key, void *data, size_t size)
+void Pipeline::collectGarbage()
 {
-    PipelineState state(this, ModifiedPipeline, key, d->modifiedPipeline[entityType], [](){});
-    d->activePipelines << state;
-    state.step();
+    //Only one batch is collected at a time
+    if (!d->collecting.isEmpty()) {
+        return;
+    }
+    QVector<QPair<QByteArray, QString> > batch;
+    bool deferred = false;
+    d->garbageStorage.scan("", [this, &batch, &deferred](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        if (Storage::isInternalKey(keyPtr, keySize)) {
+            return true;
+        }
+        const QByteArray key(static_cast<char*>(keyPtr), keySize);
+        //Entities that are still processed by another pipeline are collected in a later pass
+        bool processing = false;
+        d->progressStorage.scan(key.toStdString(), [&processing](void *, int, void *, int) -> bool {
+            processing = true;
+            return false;
+        });
+        if (processing) {
+            deferred = true;
+            return true;
+        }
+        batch << qMakePair(key, QString::fromUtf8(static_cast<char*>(valuePtr), valueSize));
+        return batch.size() < d->garbageCollectionBatchSize;
+    });
+    if (batch.isEmpty()) {
+        if (deferred) {
+            d->garbageCollectionTimer.start();
+        }
+        return;
+    }
+    qDebug() << "Pipeline: collecting " << batch.size() << " tombstones";
+
+    //The deleted pipeline is not recorded in advance, an interrupted batch is simply collected again
+    QVector<QPair<QByteArray, QString> > tombstones;
+    for (const auto &entry : batch) {
+        bool exists = false;
+        d->storage.scan(entry.first.toStdString(), [&exists](void *, int, void *, int) -> bool {
+            exists = true;
+            return false;
+        });
+        //The entity was already removed, but not its entry
+        if (!exists) {
+            d->collectedGarbage << entry.first;
+            continue;
+        }
+        d->collecting.insert(entry.first);
+        tombstones << entry;
+    }
+    scheduleStep();
+    for (const auto &entry : tombstones) {
+        startPipeline(PipelineState(this, DeletedPipeline, entry.second, entry.first, d->deletedPipeline[entry.second], []() {}));
+    }
 }
 
-void Pipeline::deletedEntity(const QString &entityType, const QByteArray &key)
+void Pipeline::reclaimGarbage()
 {
-    PipelineState state(this, DeletedPipeline, key, d->deletedPipeline[entityType], [](){});
-    d->activePipelines << state;
-    state.step();
+    if (d->collectedGarbage.isEmpty()) {
+        return;
+    }
+    //The entities are removed before their tombstone entries, so a crash in between only leaves entries without entity
+    storage().startTransaction(Storage::ReadWrite);
+    for (const auto &key : d->collectedGarbage) {
+        storage().remove(key.constData(), key.size(), [](const Storage::Error &) {});
+    }
+    storage().commitTransaction();
+    d->garbageStorage.startTransaction(Storage::ReadWrite);
+    for (const auto &key : d->collectedGarbage) {
+        d->garbageStorage.remove(key.constData(), key.size(), [](const Storage::Error &) {});
+    }
+    d->garbageStorage.commitTransaction();
+    qDebug() << "Pipeline: removed " << d->collectedGarbage.size() << " tombstones";
+    d->collectedGarbage.clear();
+    //Continue with the next batch
+    if (d->collecting.isEmpty()) {
+        d->garbageCollectionTimer.start();
+    }
 }
 
 void Pipeline::pipelineStepped(const PipelineState &state)
 {
-    scheduleStep();
+    d->pendingProgress.insert(state.key(), progressValue(state.type(), state.entityType(), state.processedPreprocessors()));
+}
+
+void Pipeline::flushProgress()
+{
+    if (d->pendingProgress.isEmpty() && d->completedPipelines.isEmpty()) {
+        return;
+    }
+    //Progress of all active pipelines is written in one transaction
+    d->progressStorage.startTransaction(Storage::ReadWrite);
+    for (auto it = d->pendingProgress.constBegin(); it != d->pendingProgress.constEnd(); ++it) {
+        d->progressStorage.write(it.key().constData(), it.key().size(), it.value().constData(), it.value().size());
+    }
+    for (const auto &key : d->completedPipelines) {
+        d->progressStorage.remove(key.constData(), key.size(), [](const Storage::Error &) {});
+    }
+    d->progressStorage.commitTransaction();
+    d->pendingProgress.clear();
+    d->completedPipelines.clear();
+    //The old entities are only removed once their pipeline is no longer resumed
+    if (!d->completedModifications.isEmpty()) {
+        d->oldEntityStorage.startTransaction(Storage::ReadWrite);
+        for (const auto &key : d->completedModifications) {
+            d->oldEntityStorage.remove(key.constData(), key.size(), [](const Storage::Error &) {});
+        }
+        d->oldEntityStorage.commitTransaction();
+        d->completedModifications.clear();
+    }
+}
+
+void Pipeline::commitPreprocessorResults()
+{
+    if (d->pendingResults.isEmpty()) {
+        return;
+    }
+    //The writes of all results end up in a single transaction per index
+    for (const auto &index : d->indexes) {
+        index->startTransaction();
+    }
+    for (const auto &result : d->pendingResults) {
+        if (result.commit) {
+            result.commit();
+        }
+    }
+    for (const auto &index : d->indexes) {
+        index->commitTransaction();
+    }
+    const auto results = d->pendingResults;
+    d->pendingResults.clear();
+    //The progress is only recorded after the writes have been committed, so an interrupted preprocessor is executed again
+    for (const auto &result : results) {
+        PipelineState(result.state).processingCompleted(result.preprocessor);
+    }
 }
 
 void Pipeline::scheduleStep()
@@ -177,28 +1021,54 @@ void Pipeline::scheduleStep()
 void Pipeline::stepPipelines()
 {
     d->stepScheduled = false;
-    for (PipelineState &state: d->activePipelines) {
-        if (state.isIdle()) {
-            state.step();
-        }
+    commitPreprocessorResults();
+    flushProgress();
+    reclaimGarbage();
+    //Only a limited number of states is stepped so we return to the event loop regularly
+    for (int i = 0; i < d->stepsPerIteration && !d->readyQueue.isEmpty(); i++) {
+        d->readyQueue.dequeue().step();
+    }
+    if (!d->readyQueue.isEmpty()) {
+        scheduleStep();
     }
 }
 
 void Pipeline::pipelineCompleted(PipelineState state)
 {
-    //TODO finalize the datastore, inform clients of the new rev
-    const int index = d->activePipelines.indexOf(state);
-    if (index > -1) {
-        d->activePipelines.remove(index);
+    d->activePipelines--;
+    if (!d->waitingPipelines.isEmpty()) {
+        scheduleState(d->waitingPipelines.dequeue());
+    }
+    d->pendingProgress.remove(state.key());
+    d->completedPipelines << state.key();
+    if (state.type() == ModifiedPipeline) {
+        d->completedModifications << state.key();
     }
+    if (state.type() == DeletedPipeline) {
+        d->collecting.remove(state.key());
+        d->collectedGarbage << state.key();
+    }
+    //The callback is responsible for finalizing the datastore and notifying about the new revision
     state.callback();
 
-    if (state.type() != NullPipeline) {
-        //TODO what revision is finalized?
-        emit revisionUpdated();
+    //The next modification of the entity can start now. One that fails doesn't start a pipeline, so the following one runs right away.
+    const QByteArray key = state.key();
+    d->activeKeys.remove(key);
+    while (!d->activeKeys.contains(key) && d->deferredModifications.contains(key)) {
+        auto &deferred = d->deferredModifications[key];
+        const auto modify = deferred.takeFirst();
+        if (deferred.isEmpty()) {
+            d->deferredModifications.remove(key);
+        }
+        modify();
     }
+
     scheduleStep();
-    if (d->activePipelines.isEmpty()) {
+    //Only emitted when the limit was reached before, so waiting feeders are resumed once
+    if (d->maxActivePipelines > 0 && d->activePipelines + 1 == d->maxActivePipelines) {
+        emit capacityAvailable();
+    }
+    if (d->activePipelines == 0) {
         emit pipelinesDrained();
     }
 }
@@ -207,26 +1077,65 @@ void Pipeline::pipelineCompleted(PipelineState state)
 class PipelineState::Private : public QSharedData
 {
 public:
-    Private(Pipeline *p, Pipeline::Type t, const QByteArray &k, QVector<Preprocessor *> filters, const std::function<void()> &c)
+    enum Status { Pending, Running, Done };
+
+    Private(Pipeline *p, Pipeline::Type t, const QString &e, const QByteArray &k, const PreprocessorGraph &g, const std::function<void()> &c)
         : pipeline(p),
           type(t),
+          entityType(e),
           key(k),
-          filterIt(filters),
-          idle(true),
+          graph(g),
+          status(g.preprocessors.size(), Pending),
+          completed(0),
+          queued(false),
+          stepping(false),
+          finished(false),
           callback(c)
     {}
 
     Private()
         : pipeline(0),
-          filterIt(QVector<Preprocessor *>()),
-          idle(true)
+          completed(0),
+          queued(false),
+          stepping(false),
+          finished(false)
     {}
 
+    bool isReady(int index) const
+    {
+        for (int dependency : graph.dependencies.at(index)) {
+            if (status.at(dependency) != Done) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //A preprocessor that only reads properties that didn't change doesn't have to run again
+    bool canSkip(int index) const
+    {
+        if (changedProperties.isEmpty()) {
+            return false;
+        }
+        const auto reads = graph.preprocessors.at(index)->readProperties();
+        return !reads.isEmpty() && !intersects(reads, changedProperties);
+    }
+
     Pipeline *pipeline;
     Pipeline::Type type;
+    QString entityType;
     QByteArray key;
-    QVectorIterator<Preprocessor *> filterIt;
-    bool idle;
+    //A copy of the entity that is shared by all preprocessors, so work items on other threads can safely access it
+    QByteArray entity;
+    QByteArray oldEntity;
+    PreprocessorGraph graph;
+    QVector<Status> status;
+    int completed;
+    QList<QByteArray> changedProperties;
+    //In the ready queue of the pipeline
+    bool queued;
+    bool stepping;
+    bool finished;
     std::function<void()> callback;
 };
 
@@ -236,8 +1145,8 @@ PipelineState::PipelineState()
 
 }
 
-PipelineState::PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback)
-    : d(new Private(pipeline, type, key, filters, callback))
+PipelineState::PipelineState(Pipeline *pipeline, Pipeline::Type type, const QString &entityType, const QByteArray &key, const PreprocessorGraph &graph, const std::function<void()> &callback)
+    : d(new Private(pipeline, type, entityType, key, graph, callback))
 {
 }
 
@@ -263,7 +1172,7 @@ bool PipelineState::operator==(const PipelineState &rhs)
 
 bool PipelineState::isIdle() const
 {
-    return d->idle;
+    return !d->queued && !d->stepping;
 }
 
 QByteArray PipelineState::key() const
@@ -276,24 +1185,68 @@ Pipeline::Type PipelineState::type() const
     return d->type;
 }
 
+QString PipelineState::entityType() const
+{
+    return d->entityType;
+}
+
+QStringList PipelineState::processedPreprocessors() const
+{
+    QStringList processed;
+    for (int i = 0; i < d->status.size(); i++) {
+        if (d->status.at(i) == Private::Done) {
+            processed << d->graph.preprocessors.at(i)->id();
+        }
+    }
+    return processed;
+}
+
+void PipelineState::skipProcessed(const QStringList &processed)
+{
+    for (int i = 0; i < d->status.size(); i++) {
+        if (d->status.at(i) == Private::Pending && processed.contains(d->graph.preprocessors.at(i)->id())) {
+            d->status[i] = Private::Done;
+            d->completed++;
+        }
+    }
+}
+
 void PipelineState::step()
 {
     if (!d->pipeline) {
         Q_ASSERT(false);
         return;
     }
+    d->queued = false;
+    if (d->finished) {
+        return;
+    }
 
-    d->idle = false;
-    if (d->filterIt.hasNext()) {
-        //TODO skip step if already processed
-        //FIXME error handling if no result is found
-        auto preprocessor = d->filterIt.next();
-        d->pipeline->storage().scan(d->key.toStdString(), [this, preprocessor](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
-            auto entity = Akonadi2::GetEntity(dataValue);
-            preprocessor->process(*this, *entity);
+    d->stepping = true;
+    //FIXME error handling if no result is found
+    if (d->entity.isEmpty() && d->completed < d->status.size()) {
+        d->pipeline->storage().scan(d->key.toStdString(), [this](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            d->entity = QByteArray(static_cast<char*>(dataValue), dataSize);
             return false;
         });
-    } else {
+    }
+    //Start all preprocessors whose dependencies are done. Dependencies always precede a preprocessor,
+    //so preprocessors that complete synchronously unblock the following ones within the same pass.
+    for (int i = 0; i < d->status.size() && !d->entity.isEmpty(); i++) {
+        if (d->status.at(i) != Private::Pending || !d->isReady(i)) {
+            continue;
+        }
+        if (d->canSkip(i)) {
+            d->status[i] = Private::Done;
+            d->completed++;
+            continue;
+        }
+        d->status[i] = Private::Running;
+        d->graph.preprocessors.at(i)->process(*this, *Akonadi2::GetEntity(d->entity.constData()));
+    }
+    d->stepping = false;
+    if (d->completed == d->status.size()) {
+        d->finished = true;
         //This object becomes invalid after this call
         d->pipeline->pipelineCompleted(*this);
     }
@@ -301,11 +1254,39 @@ void PipelineState::step()
 
 void PipelineState::processingCompleted(Preprocessor *filter)
 {
-    //TODO record processing progress
-    if (d->pipeline && filter == d->filterIt.peekPrevious()) {
-        d->idle = true;
+    if (!d->pipeline) {
+        return;
+    }
+    const int index = d->graph.preprocessors.indexOf(filter);
+    if (index > -1 && d->status.at(index) == Private::Running) {
+        d->status[index] = Private::Done;
+        d->completed++;
         d->pipeline->pipelineStepped(*this);
+        //Preprocessors that complete while the state is stepped are picked up by the same step.
+        //Otherwise the state is queued once, no matter how many preprocessors complete until it is stepped.
+        if (!d->stepping && !d->queued) {
+            d->queued = true;
+            d->pipeline->scheduleState(*this);
+        }
+    }
+}
+
+void PipelineState::setChangedProperties(const QList<QByteArray> &properties)
+{
+    d->changedProperties = properties;
+}
+
+const Akonadi2::Entity *PipelineState::oldEntity() const
+{
+    if (d->oldEntity.isEmpty()) {
+        return 0;
     }
+    return Akonadi2::GetEntity(d->oldEntity.constData());
+}
+
+void PipelineState::setOldEntity(const QByteArray &entity)
+{
+    d->oldEntity = entity;
 }
 
 void  PipelineState::callback()
@@ -313,6 +1294,24 @@ void  PipelineState::callback()
     d->callback();
 }
 
+void PipelineState::executeConcurrently(Preprocessor *preprocessor, const std::function<std::function<void()>()> &work) const
+{
+    PipelineState state(*this);
+    Pipeline *pipeline = d->pipeline;
+    pipeline->d->threadPool.start(new WorkItem([state, pipeline, preprocessor, work]() {
+        const auto commit = work();
+        //The results are committed in batches by the next step of the pipeline
+        pipeline->d->threadBoundary.callInMainThread([state, pipeline, preprocessor, commit]() {
+            PreprocessorResult result;
+            result.state = state;
+            result.preprocessor = preprocessor;
+            result.commit = commit;
+            pipeline->d->pendingResults << result;
+            pipeline->scheduleStep();
+        });
+    }));
+}
+
 
 Preprocessor::Preprocessor()
     : d(0)
@@ -338,5 +1337,54 @@ QString Preprocessor::id() const
     return QLatin1String("unknown processor");
 }
 
+QList<QByteArray> Preprocessor::readProperties() const
+{
+    return QList<QByteArray>();
+}
+
+QList<QByteArray> Preprocessor::writtenProperties() const
+{
+    return QList<QByteArray>();
+}
+
+
+ConcurrentPreprocessor::ConcurrentPreprocessor()
+    : Preprocessor()
+{
+}
+
+void ConcurrentPreprocessor::process(const PipelineState &state, const Akonadi2::Entity &entity)
+{
+    //The entities are owned by the state, which is kept alive until the work item completed
+    const QByteArray key = state.key();
+    const Akonadi2::Entity *e = &entity;
+    const Akonadi2::Entity *oldEntity = state.oldEntity();
+    const bool removal = state.type() == Pipeline::DeletedPipeline;
+    state.executeConcurrently(this, [this, key, e, oldEntity, removal]() {
+        if (removal) {
+            return processRemovalConcurrently(key, *e);
+        }
+        if (oldEntity) {
+            return processModificationConcurrently(key, *oldEntity, *e);
+        }
+        return processConcurrently(key, *e);
+    });
+}
+
+std::function<void()> ConcurrentPreprocessor::processModificationConcurrently(const QByteArray &key, const Akonadi2::Entity &oldEntity, const Akonadi2::Entity &newEntity)
+{
+    return processConcurrently(key, newEntity);
+}
+
+std::function<void()> ConcurrentPreprocessor::processRemovalConcurrently(const QByteArray &key, const Akonadi2::Entity &entity)
+{
+    return std::function<void()>();
+}
+
+QStringList ConcurrentPreprocessor::writtenIndexes() const
+{
+    return QStringList();
+}
+
 } // namespace Akonadi2
 
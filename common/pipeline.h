@@ -24,6 +24,8 @@
 
 #include <QSharedDataPointer>
 #include <QObject>
+#include <QVector>
+#include <QStringList>
 
 #include <akonadi2common_export.h>
 #include <storage.h>
@@ -31,12 +33,22 @@
 
 #include "entity_generated.h"
 
+class DomainTypeAdaptorFactoryInterface;
+class Index;
+
 namespace Akonadi2
 {
 
 class PipelineState;
 class Preprocessor;
 
+//The preprocessors of a pipeline, and for each of them the indexes of the preprocessors it has to wait for
+struct PreprocessorGraph
+{
+    QVector<Preprocessor *> preprocessors;
+    QVector<QVector<int> > dependencies;
+};
+
 class AKONADI2COMMON_EXPORT Pipeline : public QObject
 {
     Q_OBJECT
@@ -49,26 +61,107 @@ public:
 
     Storage &storage() const;
 
+    /**
+     * Sets the preprocessors of a pipeline.
+     *
+     * The preprocessors are scheduled according to the properties they declare to read and write,
+     * so independent preprocessors run concurrently. The order only matters for conflicting preprocessors.
+     */
     void setPreprocessors(const QString &entityType, Type pipelineType, const QVector<Preprocessor *> &preprocessors);
+    //The factory is used to verify the buffers of new entities and to merge modifications.
+    //Readers trust entities from the storage, so every entity type should have a factory.
+    void setAdaptorFactory(const QString &entityType, const QSharedPointer<DomainTypeAdaptorFactoryInterface> &factory);
+    /**
+     * Returns the index with the given name, which is stored in resourceName.index.name.
+     *
+     * Index writes of the functions returned by concurrent preprocessors are committed together with the writes of
+     * the other preprocessors completing in the same step, before their progress is recorded.
+     */
+    Index &index(const QString &name);
 
     void null();
 
     Async::Job<void> newEntity(void const *command, size_t size);
-    void modifiedEntity(const QString &entityType, const QByteArray &key, void *data, size_t size);
-    void deletedEntity(const QString &entityType, const QByteArray &key);
+    /**
+     * Creates a batch of entities within a single write transaction.
+     *
+     * The entities get consecutive revisions and the job completes once they are stored.
+     * The preprocessors run afterwards, their progress is recorded so they can be resumed using resumePipelines.
+     */
+    Async::Job<void> newEntities(const QVector<QByteArray> &commands);
+    //True while preprocessors are running, pipelinesDrained is emitted once they are done
+    bool isProcessing() const;
+    //Restarts the outstanding preprocessors of entities whose processing was interrupted.
+    //Modified entities are processed against the previous revision that was recorded with the modification.
+    void resumePipelines();
+    /**
+     * Rebuilds the indexes written by the concurrent preprocessors of the new pipeline from the stored entities.
+     *
+     * Only the preprocessors with the given ids are executed, or all of them if ids is empty.
+     * The entity store is read in key partitions on the thread pool, the index writes are collected in memory
+     * and every index is replaced by a bulk load of its sorted values. Must not be called while entities are processed.
+     */
+    bool rebuildIndexes(const QString &entityType, const QStringList &ids = QStringList(), int partitions = 0);
+    /**
+     * Rekeys the entities that are still stored with their printable key to the binary key,
+     * including the progress records and tombstones that refer to them.
+     *
+     * The indexes still refer to the printable keys afterwards, so they have to be rebuilt.
+     * Returns the number of migrated entities, or -1 on failure. Must not be called while entities are processed.
+     */
+    int migrateEntityKeys();
+    /**
+     * Merges the delta and deletions of a ModifyEntity command into the stored entity and writes it in a new revision.
+     *
+     * The modified pipeline gets the old entity and the changed properties, so preprocessors can update incrementally.
+     * Modifications of entities that don't exist (anymore) are dropped with a warning.
+     */
+    Async::Job<void> modifiedEntity(void const *command, size_t size);
+    /**
+     * Replaces the entity of a DeleteEntity command with a tombstone in a new revision, which hides it from queries.
+     *
+     * The deleted pipeline and the removal of the entity are deferred to the garbage collection,
+     * which processes the tombstones in batches.
+     * Deletions of entities that don't exist (anymore) are dropped with a warning.
+     */
+    Async::Job<void> deletedEntity(void const *command, size_t size);
+    //The maximum number of pipeline states that are stepped before returning to the event loop
+    void setStepsPerIteration(int steps);
+    /**
+     * Limits the number of pipelines that are processed at the same time. 0 means unlimited.
+     *
+     * Pipelines started beyond the limit wait until others completed. Their entities are already stored though,
+     * so callers are expected to stop feeding the pipeline until capacityAvailable is emitted.
+     */
+    void setMaxActivePipelines(int max);
+    //The number of pipelines that can be started before the limit is reached
+    int availableCapacity() const;
+    //The garbage collection runs msecs after a deletion, and processes at most batchSize tombstones at a time.
+    void setGarbageCollection(int msecs, int batchSize);
 
 Q_SIGNALS:
     void revisionUpdated();
     void pipelinesDrained();
+    //Emitted when the number of active pipelines drops below the limit again
+    void capacityAvailable();
 
 private Q_SLOTS:
     void stepPipelines();
+    void collectGarbage();
 
 private:
+    bool storeNewEntity(void const *command, size_t size, qint64 revision, QByteArray &key, QString &entityType);
+    bool storeEntity(const QByteArray &key, qint64 revision, const Akonadi2::Entity &entity, bool deleted = false);
+    bool verifyEntity(const QString &entityType, const void *data, size_t size);
+    void startPipeline(const PipelineState &state);
+    void scheduleState(const PipelineState &state);
     void pipelineStepped(const PipelineState &state);
     //Don't use a reference here (it would invalidate itself)
     void pipelineCompleted(PipelineState state);
     void scheduleStep();
+    void flushProgress();
+    void commitPreprocessorResults();
+    void reclaimGarbage();
 
     friend class PipelineState;
 
@@ -80,7 +173,7 @@ class AKONADI2COMMON_EXPORT PipelineState
 {
 public:
     PipelineState();
-    PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback);
+    PipelineState(Pipeline *pipeline, Pipeline::Type type, const QString &entityType, const QByteArray &key, const PreprocessorGraph &graph, const std::function<void()> &callback);
     PipelineState(const PipelineState &other);
     ~PipelineState();
 
@@ -90,10 +183,23 @@ public:
     bool isIdle() const;
     QByteArray key() const;
     Pipeline::Type type() const;
+    QString entityType() const;
     //TODO expose command
 
+    //The ids of the preprocessors that completed
+    QStringList processedPreprocessors() const;
+    //Marks the preprocessors with the given ids as completed, so they are not executed again
+    void skipProcessed(const QStringList &processed);
+
     void step();
     void processingCompleted(Preprocessor *filter);
+    //Preprocessors that only read properties not in this list are skipped. An empty list runs all preprocessors.
+    void setChangedProperties(const QList<QByteArray> &properties);
+    //The entity before the modification, or 0 if there is none (i.e. for new entities or resumed pipelines)
+    const Akonadi2::Entity *oldEntity() const;
+    void setOldEntity(const QByteArray &entity);
+    //Runs work on the thread pool of the pipeline, and the returned function followed by processingCompleted on the pipeline thread
+    void executeConcurrently(Preprocessor *preprocessor, const std::function<std::function<void()>()> &work) const;
 
     void callback();
 
@@ -112,6 +218,11 @@ public:
     virtual void process(const PipelineState &state, const Akonadi2::Entity &);
     //TODO to record progress
     virtual QString id() const;
+    //The properties this preprocessor depends on. An empty list means it depends on the whole entity.
+    virtual QList<QByteArray> readProperties() const;
+    //The properties this preprocessor modifies.
+    //A preprocessor that declares neither reads nor writes is executed strictly in order with all others.
+    virtual QList<QByteArray> writtenProperties() const;
 
 protected:
     void processingCompleted(PipelineState state);
@@ -121,5 +232,27 @@ private:
     Private * const d;
 };
 
+/**
+ * A preprocessor that runs on a worker thread of the pipeline.
+ *
+ * This allows to process independent entities in parallel.
+ * processConcurrently must not touch any shared state, writes have to be done in the returned function,
+ * which is executed on the pipeline thread.
+ */
+class AKONADI2COMMON_EXPORT ConcurrentPreprocessor : public Preprocessor
+{
+public:
+    ConcurrentPreprocessor();
+
+    void process(const PipelineState &state, const Akonadi2::Entity &) Q_DECL_OVERRIDE;
+    virtual std::function<void()> processConcurrently(const QByteArray &key, const Akonadi2::Entity &) = 0;
+    //Called instead of processConcurrently for modifications. By default the new entity is processed like a new one.
+    virtual std::function<void()> processModificationConcurrently(const QByteArray &key, const Akonadi2::Entity &oldEntity, const Akonadi2::Entity &newEntity);
+    //Called instead of processConcurrently for deletions, with the entity as it was before the deletion. Does nothing by default.
+    virtual std::function<void()> processRemovalConcurrently(const QByteArray &key, const Akonadi2::Entity &entity);
+    //The indexes of the pipeline the returned functions write to, which are replaced as a whole when the indexes are rebuilt
+    virtual QStringList writtenIndexes() const;
+};
+
 } // namespace Akonadi2
 
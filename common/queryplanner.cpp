@@ -0,0 +1,328 @@
+#include "queryplanner.h"
+#include "index.h"
+#include "storage.h"
+#include <QDebug>
+#include <QDateTime>
+#include <QSet>
+#include <QStringList>
+#include <algorithm>
+#include <limits>
+
+//Estimates count the values of a path up to this limit
+static const int s_estimateLimit = 1000;
+//An ordered walk with a limit is assumed to read this many values per result, as other filters reject some of them
+static const int s_orderedWalkFactor = 4;
+//Reading the keys of a path to intersect them only pays off if there are not many more than values of the driving path
+static const int s_intersectionFactor = 4;
+//Equality filters with several values are expanded into up to this many lookups
+static const int s_maxExpansion = 64;
+
+QueryPlanner::QueryPlanner(const IndexAccessor &indexAccessor)
+    : mIndexAccessor(indexAccessor)
+{
+}
+
+void QueryPlanner::addIndex(const QList<QByteArray> &properties)
+{
+    mIndexes << properties;
+}
+
+void QueryPlanner::addIntervalIndex(const QByteArray &startProperty, const QByteArray &endProperty)
+{
+    mIntervalIndexes << qMakePair(startProperty, endProperty);
+}
+
+void QueryPlanner::setFullTextIndex(const QString &name)
+{
+    mFullTextIndex = name;
+}
+
+QVariantList QueryPlanner::filterValues(const QVariant &filter)
+{
+    if (filter.type() == QVariant::List || filter.type() == QVariant::StringList) {
+        return filter.toList();
+    }
+    return QVariantList() << filter;
+}
+
+QList<QPair<QString, bool> > QueryPlanner::parseTextSearch(const QString &search)
+{
+    QList<QPair<QString, bool> > terms;
+    for (const auto &word : search.split(' ', QString::SkipEmptyParts)) {
+        const bool prefix = word.endsWith('*');
+        const auto tokens = Index::tokenize(word);
+        for (int i = 0; i < tokens.size(); i++) {
+            terms << qMakePair(tokens.at(i), prefix && i == tokens.size() - 1);
+        }
+    }
+    return terms;
+}
+
+QList<QueryPlanner::AccessPath> QueryPlanner::accessPaths(const Akonadi2::Query &query) const
+{
+    QList<AccessPath> paths;
+    const QByteArray sortProperty = query.sortProperty.toLatin1();
+
+    if (!query.ids.isEmpty()) {
+        //Entities created before binary keys were introduced are stored with their printable key until akonadi2_reindex --migrate-keys ran
+        AccessPath path;
+        path.description = "ids";
+        for (const auto &id : query.ids) {
+            path.keys << id.toUtf8() << Akonadi2::Storage::entityKey(id.toUtf8());
+        }
+        paths << path;
+    }
+
+    //An index answers equality filters on its leading properties, optionally followed by a range filter on the next one.
+    //If the next property is the sort property, walking the index also returns the values in order.
+    for (const auto &properties : mIndexes) {
+        AccessPath path;
+        QStringList description;
+        for (const auto &property : properties) {
+            path.index += (path.index.isEmpty() ? "" : ".") + QString::fromLatin1(property);
+        }
+        QList<QByteArray> prefixes;
+        prefixes << QByteArray();
+        int equalities = 0;
+        while (equalities < properties.size() && query.propertyFilter.contains(properties.at(equalities))) {
+            const auto values = filterValues(query.propertyFilter.value(properties.at(equalities)));
+            if (prefixes.size() * values.size() > s_maxExpansion) {
+                break;
+            }
+            QList<QByteArray> expanded;
+            for (const auto &prefix : prefixes) {
+                for (const auto &value : values) {
+                    expanded << prefix + Index::encodeValue(value, equalities == properties.size() - 1);
+                }
+            }
+            prefixes = expanded;
+            QStringList shown;
+            for (const auto &value : values) {
+                shown << value.toString();
+            }
+            description << QString::fromLatin1(properties.at(equalities)) + (values.size() > 1 ? " in (" + shown.join(", ") + ")" : " = " + shown.join(""));
+            equalities++;
+        }
+
+        if (equalities == properties.size()) {
+            path.keys = prefixes;
+        } else {
+            const auto next = properties.at(equalities);
+            const bool range = query.rangeFilter.contains(next);
+            path.ordered = next == sortProperty && prefixes.size() == 1;
+            path.filters = equalities > 0 || range;
+            if (!path.filters && !path.ordered) {
+                continue;
+            }
+            path.descending = path.ordered && query.sortDescending;
+            const bool last = equalities == properties.size() - 1;
+            for (const auto &prefix : prefixes) {
+                QByteArray lower = prefix;
+                QByteArray upper = Index::prefixUpperBound(prefix);
+                if (range) {
+                    const auto bounds = query.rangeFilter.value(next);
+                    if (bounds.lower.isValid()) {
+                        lower += Index::encodeValue(bounds.lower, last);
+                    }
+                    if (bounds.upper.isValid()) {
+                        //Includes all keys that start with the upper bound
+                        upper = Index::prefixUpperBound(prefix + Index::encodeValue(bounds.upper, last));
+                    }
+                }
+                path.ranges << qMakePair(lower, upper);
+            }
+            if (range) {
+                description << QString::fromLatin1(next) + " in range";
+            }
+            if (path.ordered) {
+                description << "ordered by " + QString::fromLatin1(next);
+            }
+        }
+        path.description = "index " + path.index + ": " + description.join(", ");
+        paths << path;
+    }
+
+    if (!query.overlapFilter.startProperty.isEmpty()) {
+        for (const auto &interval : mIntervalIndexes) {
+            if (interval.first != query.overlapFilter.startProperty.toLatin1() || interval.second != query.overlapFilter.endProperty.toLatin1()) {
+                continue;
+            }
+            const auto range = query.overlapFilter.range;
+            AccessPath path;
+            path.index = QString::fromLatin1(interval.first + "." + interval.second + ".interval");
+            path.description = "index " + path.index + ": overlapping range";
+            path.ranges = Index::intervalRanges(range.lower.isValid() ? range.lower.toDateTime().toMSecsSinceEpoch() : std::numeric_limits<qint64>::min(),
+                                                range.upper.isValid() ? range.upper.toDateTime().toMSecsSinceEpoch() : std::numeric_limits<qint64>::max());
+            paths << path;
+        }
+    }
+
+    if (!mFullTextIndex.isEmpty()) {
+        //Every word is a path of its own, so the rarest one drives the query and the others are intersected
+        for (const auto &term : parseTextSearch(query.textSearch)) {
+            AccessPath path;
+            path.index = mFullTextIndex;
+            const auto word = term.first.toUtf8();
+            if (term.second) {
+                path.ranges << qMakePair(word, Index::prefixUpperBound(word));
+                path.description = "index " + path.index + ": words starting with " + term.first;
+            } else {
+                path.keys << word;
+                path.description = "index " + path.index + ": word " + term.first;
+            }
+            paths << path;
+        }
+    }
+    return paths;
+}
+
+bool QueryPlanner::walk(const AccessPath &path, const std::function<bool(const QByteArray &key)> &handler) const
+{
+    if (path.index.isEmpty()) {
+        for (const auto &key : path.keys) {
+            if (!handler(key)) {
+                break;
+            }
+        }
+        return true;
+    }
+    const auto index = mIndexAccessor(path.index);
+    if (!index) {
+        return false;
+    }
+
+    bool failed = false;
+    bool done = false;
+    const auto errorHandler = [&failed](const Index::Error &error) {
+        qWarning() << "Error in index: " <<  QString::fromStdString(error.message);
+        failed = true;
+    };
+    //All values of a key are in the range up to the smallest longer key
+    auto ranges = path.ranges;
+    for (const auto &key : path.keys) {
+        //Keys that are definitely absent don't have to be looked up
+        if (index->mayContain(key)) {
+            ranges << qMakePair(key, key + '\0');
+        }
+    }
+    for (const auto &range : ranges) {
+        index->lookupRange(range.first, range.second, [&done, &handler](const QByteArray &, const QByteArray &value) -> bool {
+            done = !handler(value);
+            return !done;
+        }, errorHandler, path.descending);
+        if (done || failed) {
+            break;
+        }
+    }
+    return !failed;
+}
+
+static int cost(const QueryPlanner::AccessPath &path, const Akonadi2::Query &query)
+{
+    if (path.ordered && query.limit > 0) {
+        return qMin(path.estimate, query.limit * s_orderedWalkFactor);
+    }
+    return path.estimate;
+}
+
+QueryPlanner::Plan QueryPlanner::plan(const Akonadi2::Query &query) const
+{
+    Plan plan;
+    QList<AccessPath> paths;
+    for (auto path : accessPaths(query)) {
+        int count = 0;
+        const bool available = walk(path, [&count](const QByteArray &) -> bool {
+            return ++count < s_estimateLimit;
+        });
+        //Paths on indexes that don't exist yet are skipped
+        if (available) {
+            path.estimate = count;
+            paths << path;
+        }
+    }
+
+    int driver = -1;
+    for (int i = 0; i < paths.size(); i++) {
+        if (driver < 0) {
+            driver = i;
+            continue;
+        }
+        const int current = cost(paths.at(i), query);
+        const int best = cost(paths.at(driver), query);
+        if (current < best || (current == best && paths.at(i).ordered && !paths.at(driver).ordered)) {
+            driver = i;
+        }
+    }
+
+    if (driver >= 0) {
+        plan.paths << paths.at(driver);
+        const int driverCost = cost(paths.at(driver), query);
+        for (int i = 0; i < paths.size(); i++) {
+            const auto &path = paths.at(i);
+            if (i != driver && path.filters && path.estimate < s_estimateLimit && path.estimate <= s_intersectionFactor * qMax(driverCost, 1)) {
+                plan.paths << path;
+            }
+        }
+    }
+
+    plan.sorted = query.sortProperty.isEmpty() ||
+        (query.propertyFilter.contains(query.sortProperty) && filterValues(query.propertyFilter.value(query.sortProperty)).size() == 1) ||
+        (driver >= 0 && paths.at(driver).ordered);
+    return plan;
+}
+
+bool QueryPlanner::execute(const Plan &plan, const std::function<bool(const QByteArray &key)> &handler) const
+{
+    if (plan.paths.isEmpty()) {
+        return false;
+    }
+    //The keys of the intersected paths are collected first, so the driving path can stop early
+    QVector<QSet<QByteArray> > intersections;
+    for (int i = 1; i < plan.paths.size(); i++) {
+        QSet<QByteArray> keys;
+        if (!walk(plan.paths.at(i), [&keys](const QByteArray &key) -> bool {
+            keys.insert(key);
+            return true;
+        })) {
+            return false;
+        }
+        if (keys.isEmpty()) {
+            return true;
+        }
+        intersections << keys;
+    }
+    std::sort(intersections.begin(), intersections.end(), [](const QSet<QByteArray> &left, const QSet<QByteArray> &right) {
+        return left.size() < right.size();
+    });
+    //A key can be found more than once, i.e. for several words of an entity that start with the same prefix
+    QSet<QByteArray> seen;
+    return walk(plan.paths.first(), [&intersections, &seen, &handler](const QByteArray &key) -> bool {
+        for (const auto &keys : intersections) {
+            if (!keys.contains(key)) {
+                return true;
+            }
+        }
+        if (seen.contains(key)) {
+            return true;
+        }
+        seen.insert(key);
+        return handler(key);
+    });
+}
+
+QString QueryPlanner::explain(const Plan &plan)
+{
+    QStringList lines;
+    if (plan.paths.isEmpty()) {
+        lines << "full scan";
+    }
+    for (int i = 0; i < plan.paths.size(); i++) {
+        const auto &path = plan.paths.at(i);
+        const QString estimate = path.estimate < s_estimateLimit ? QString::number(path.estimate) : QString(">= %1").arg(s_estimateLimit);
+        lines << QString("%1 %2 (%3 values)").arg(i ? "intersect with" : "walk").arg(path.description).arg(estimate);
+    }
+    if (!plan.sorted) {
+        lines << "sort in memory";
+    }
+    return lines.join("\n");
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <functional>
+#include <QString>
+#include <QList>
+#include <QVector>
+#include <QPair>
+#include <QSharedPointer>
+#include "clientapi.h"
+
+class Index;
+
+/**
+ * Chooses the indexes that answer a query.
+ *
+ * Each filter an index can answer yields an access path, with an estimate of the number of values it returns.
+ * The cheapest path drives the query, and the values of other cheap paths are intersected with it.
+ * Without any path the query falls back to a full scan.
+ *
+ * Indexes only narrow down the candidates, so all filters still have to be checked on the values.
+ */
+class QueryPlanner
+{
+public:
+    //A walk over an index, or a lookup of entity keys if there is no index
+    struct AccessPath {
+        AccessPath() : filters(true), ordered(false), descending(false), estimate(0) {}
+        QString index;
+        QString description;
+        //The keys whose values are returned, in addition to all values of the ranges [lower, upper)
+        QList<QByteArray> keys;
+        QVector<QPair<QByteArray, QByteArray> > ranges;
+        //False for walks that are only used for their order
+        bool filters;
+        //The values are returned ordered by the sort property of the query
+        bool ordered;
+        bool descending;
+        //The number of values, if it is below the estimate limit
+        int estimate;
+    };
+
+    struct Plan {
+        Plan() : sorted(false) {}
+        //The first path drives the query and the others are intersected with it. Empty for a full scan.
+        QList<AccessPath> paths;
+        //The candidates are returned ordered by the sort property of the query
+        bool sorted;
+    };
+
+    //Returns a null pointer for indexes that don't exist (yet)
+    typedef std::function<QSharedPointer<Index>(const QString &name)> IndexAccessor;
+
+    QueryPlanner(const IndexAccessor &indexAccessor);
+
+    //An index of the encoded values of properties, as written with Index::encodeKey
+    void addIndex(const QList<QByteArray> &properties);
+    //An interval index of a start and end property, as written with Index::intervalKey
+    void addIntervalIndex(const QByteArray &startProperty, const QByteArray &endProperty);
+    //An index from the words returned by Index::tokenize to the entities containing them
+    void setFullTextIndex(const QString &name);
+
+    Plan plan(const Akonadi2::Query &query) const;
+    //Calls the handler with each candidate key once, until it returns false.
+    //Returns false if an index could not be read, in which case the query has to fall back to a full scan.
+    bool execute(const Plan &plan, const std::function<bool(const QByteArray &key)> &handler) const;
+    //A readable description of the plan for debugging
+    static QString explain(const Plan &plan);
+
+    //A list as filter value matches any of its values
+    static QVariantList filterValues(const QVariant &filter);
+    //The words of a text search, and whether they only have to be the prefix of a word
+    static QList<QPair<QString, bool> > parseTextSearch(const QString &search);
+
+private:
+    QList<AccessPath> accessPaths(const Akonadi2::Query &query) const;
+    bool walk(const AccessPath &path, const std::function<bool(const QByteArray &key)> &handler) const;
+
+    IndexAccessor mIndexAccessor;
+    QList<QList<QByteArray> > mIndexes;
+    QList<QPair<QByteArray, QByteArray> > mIntervalIndexes;
+    QString mFullTextIndex;
+};
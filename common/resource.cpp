@@ -19,6 +19,7 @@
  */
 
 #include "resource.h"
+#include "deadletters_generated.h"
 
 #include <QCoreApplication>
 #include <QDir>
@@ -44,6 +45,11 @@ void Resource::configurePipeline(Pipeline *pipeline)
 
 }
 
+void Resource::setThrottleHandler(const std::function<void(bool throttled)> &handler)
+{
+    Q_UNUSED(handler)
+}
+
 void Resource::processCommand(int commandId, const QByteArray &data, uint size, Pipeline *pipeline)
 {
     Q_UNUSED(commandId)
@@ -65,6 +71,13 @@ Async::Job<void> Resource::processAllMessages()
     return Async::null<void>();
 }
 
+void Resource::inspectDeadLetters(flatbuffers::FlatBufferBuilder &fbb)
+{
+    auto letters = fbb.CreateVector(std::vector<flatbuffers::Offset<DeadLetter> >());
+    auto location = CreateDeadLetters(fbb, letters);
+    FinishDeadLettersBuffer(fbb, location);
+}
+
 class ResourceFactory::Private
 {
 public:
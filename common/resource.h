@@ -36,9 +36,14 @@ public:
     virtual void processCommand(int commandId, const QByteArray &data, uint size, Pipeline *pipeline);
     virtual Async::Job<void> synchronizeWithSource(Pipeline *pipeline);
     virtual Async::Job<void> processAllMessages();
+    //Writes a DeadLetters buffer listing all commands that repeatedly failed to process
+    virtual void inspectDeadLetters(flatbuffers::FlatBufferBuilder &fbb);
 
     virtual void configurePipeline(Pipeline *pipeline);
 
+    //The handler is called with true once the resource can't keep up with incoming commands, and with false once it caught up again.
+    virtual void setThrottleHandler(const std::function<void(bool throttled)> &handler);
+
 private:
     class Private;
     Private * const d;
@@ -22,7 +22,10 @@
 
 #include "common/console.h"
 #include "common/commands.h"
+#include "common/messagequeue.h"
+#include "common/clientqueueupdate_generated.h"
 #include "common/commandcompletion_generated.h"
+#include "common/deadletters_generated.h"
 #include "common/handshake_generated.h"
 #include "common/revisionupdate_generated.h"
 #include "common/synchronize_generated.h"
@@ -31,6 +34,7 @@
 #include <QDebug>
 #include <QDir>
 #include <QProcess>
+#include <QStandardPaths>
 
 namespace Akonadi2
 {
@@ -82,7 +86,9 @@ public:
     flatbuffers::FlatBufferBuilder fbb;
     QVector<QueuedCommand *> commandQueue;
     QMultiMap<uint, std::function<void(int error, const QString &errorMessage)> > resultHandler;
+    QSharedPointer<MessageQueue> clientQueue;
     uint messageId;
+    int revisionUpdateInterval;
 };
 
 ResourceAccess::Private::Private(const QString &name, ResourceAccess *q)
@@ -90,7 +96,8 @@ ResourceAccess::Private::Private(const QString &name, ResourceAccess *q)
       socket(new QLocalSocket(q)),
       tryOpenTimer(new QTimer(q)),
       startingProcess(false),
-      messageId(0)
+      messageId(0),
+      revisionUpdateInterval(0)
 {
 }
 
@@ -203,6 +210,23 @@ Async::Job<void>  ResourceAccess::sendCommand(int commandId, flatbuffers::FlatBu
     });
 }
 
+Async::Job<void> ResourceAccess::enqueueCommand(int commandId, flatbuffers::FlatBufferBuilder &fbb)
+{
+    if (!d->clientQueue) {
+        d->clientQueue = QSharedPointer<MessageQueue>::create(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", d->resourceName + ".clientqueue");
+    }
+
+    flatbuffers::FlatBufferBuilder queuedFbb;
+    Commands::createQueuedCommand(queuedFbb, commandId, fbb.GetBufferPointer(), fbb.GetSize());
+    const qint64 revision = d->clientQueue->enqueue(queuedFbb.GetBufferPointer(), queuedFbb.GetSize());
+    log(QString("Enqueued command %1 with revision %2").arg(commandId).arg(revision));
+
+    flatbuffers::FlatBufferBuilder notificationFbb;
+    auto location = Akonadi2::CreateClientQueueUpdate(notificationFbb, revision);
+    Akonadi2::FinishClientQueueUpdateBuffer(notificationFbb, location);
+    return sendCommand(Commands::ClientQueueUpdateCommand, notificationFbb);
+}
+
 Async::Job<void> ResourceAccess::synchronizeResource(bool sourceSync, bool localSync)
 {
     auto command = Akonadi2::CreateSynchronize(d->fbb, sourceSync, localSync);
@@ -211,6 +235,11 @@ Async::Job<void> ResourceAccess::synchronizeResource(bool sourceSync, bool local
     d->fbb.Clear();
 }
 
+void ResourceAccess::setRevisionUpdateInterval(int msecs)
+{
+    d->revisionUpdateInterval = msecs;
+}
+
 void ResourceAccess::open()
 {
     if (d->socket->isValid()) {
@@ -244,7 +273,7 @@ void ResourceAccess::connected()
 
     {
         auto name = d->fbb.CreateString(QString::number(QCoreApplication::applicationPid()).toLatin1());
-        auto command = Akonadi2::CreateHandshake(d->fbb, name);
+        auto command = Akonadi2::CreateHandshake(d->fbb, name, d->revisionUpdateInterval);
         Akonadi2::FinishHandshakeBuffer(d->fbb, command);
         Commands::write(d->socket, ++d->messageId, Commands::HandshakeCommand, d->fbb);
         d->fbb.Clear();
@@ -343,6 +372,16 @@ bool ResourceAccess::processMessageBuffer()
 
             break;
         }
+        case Commands::DeadLettersCommand: {
+            auto buffer = GetDeadLetters(d->partialMessageBuffer.constData() + headerSize);
+            const int count = buffer->letters() ? buffer->letters()->size() : 0;
+            log(QString("%1 dead letters").arg(count));
+            for (int i = 0; i < count; i++) {
+                auto letter = buffer->letters()->Get(i);
+                log(QString("\tDead letter %1: command %2 of size %3").arg(letter->key() ? letter->key()->c_str() : "").arg(letter->commandId()).arg(letter->size()));
+            }
+            break;
+        }
         case Commands::CommandCompletion: {
             auto buffer = GetCommandCompletion(d->partialMessageBuffer.constData() + headerSize);
             log(QString("Command with messageId %1 completed %2").arg(buffer->id()).arg(buffer->success() ? "sucessfully" : "unsuccessfully"));
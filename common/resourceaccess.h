@@ -43,7 +43,15 @@ public:
 
     Async::Job<void> sendCommand(int commandId);
     Async::Job<void> sendCommand(int commandId, flatbuffers::FlatBufferBuilder &fbb);
+    /**
+     * Writes the command directly to the client queue in the resource storage, and only sends a notification to the resource.
+     *
+     * This avoids copying the command over the socket, but requires write access to the resource storage.
+     */
+    Async::Job<void> enqueueCommand(int commandId, flatbuffers::FlatBufferBuilder &fbb);
     Async::Job<void> synchronizeResource(bool remoteSync, bool localSync);
+    //Limits revisionChanged to once per interval, the latest revision is always delivered eventually. Takes effect on the next connection.
+    void setRevisionUpdateInterval(int msecs);
 
 public Q_SLOTS:
     void open();
@@ -25,6 +25,7 @@
 #include <string>
 #include <functional>
 #include <QString>
+#include <QByteArray>
 
 namespace Akonadi2
 {
@@ -54,6 +55,11 @@ public:
     //TODO: query?
     bool write(const void *key, size_t keySize, const void *value, size_t valueSize);
     bool write(const std::string &sKey, const std::string &sValue);
+    //Reserves valueSize bytes in the database and lets writer fill them in place, which avoids copying the value
+    bool write(const void *key, size_t keySize, size_t valueSize, const std::function<void(void *valuePtr)> &writer);
+    //Writes a value that sorts after all stored values, i.e. for bulk loads of sorted values.
+    //This avoids searching the tree for every value, but fails if the values are not in order.
+    bool append(const void *key, size_t keySize, const void *value, size_t valueSize);
     void read(const std::string &sKey,
               const std::function<bool(const std::string &value)> &resultHandler);
     void read(const std::string &sKey,
@@ -67,9 +73,20 @@ public:
     void scan(const char *keyData, uint keySize,
               const std::function<bool(void *keyPtr, int keySize, void *ptr, int size)> &resultHandler,
               const std::function<void(const Storage::Error &error)> &errorHandler);
+    //Iterates over all values with lower <= key < upper in key order, or in reverse order if descending is set.
+    //Empty bounds are unlimited. Return false from the result handler to stop.
+    void scanRange(const QByteArray &lower, const QByteArray &upper, bool descending,
+              const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+              const std::function<void(const Storage::Error &error)> &errorHandler);
     void remove(void const *keyData, uint keySize);
     void remove(void const *keyData, uint keySize,
                 const std::function<void(const Storage::Error &error)> &errorHandler);
+    //Removes a single value of a key, the other values of the key are kept if duplicates are allowed
+    void remove(void const *keyData, uint keySize, void const *valueData, uint valueSize,
+                const std::function<void(const Storage::Error &error)> &errorHandler);
+
+    //Removes all values, including the internal ones
+    bool removeAll();
 
     static std::function<void(const Storage::Error &error)> basicErrorHandler();
     qint64 diskUsage() const;
@@ -84,6 +101,14 @@ public:
     static bool isInternalKey(void *key, int keySize);
     static bool isInternalKey(const QByteArray &key);
 
+    //Entity keys are stored as 16 byte binary uuids. Only use the printable form at the API boundary and for debug output.
+    static QByteArray createEntityKey();
+    //Legacy keys that are already printable are returned as is
+    static QByteArray printableKey(const QByteArray &key);
+    //Returns the binary form of a printable key, other keys are returned as is.
+    //Entities stored with their printable key can't be found with it, they have to be migrated using akonadi2_reindex --migrate-keys.
+    static QByteArray entityKey(const QByteArray &printableKey);
+
 private:
     class Private;
     Private * const d;
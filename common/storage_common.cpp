@@ -21,6 +21,7 @@
 #include "storage.h"
 
 #include <iostream>
+#include <QUuid>
 
 namespace Akonadi2
 {
@@ -93,4 +94,33 @@ bool Storage::isInternalKey(const QByteArray &key)
     return key.startsWith(s_internalPrefix);
 }
 
+static const int s_binaryKeySize = 16;
+//"{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}"
+static const int s_printableKeySize = 38;
+
+QByteArray Storage::createEntityKey()
+{
+    return QUuid::createUuid().toRfc4122();
+}
+
+QByteArray Storage::printableKey(const QByteArray &key)
+{
+    if (key.size() != s_binaryKeySize) {
+        return key;
+    }
+    return QUuid::fromRfc4122(key).toByteArray();
+}
+
+QByteArray Storage::entityKey(const QByteArray &printableKey)
+{
+    if (printableKey.size() != s_printableKeySize) {
+        return printableKey;
+    }
+    const QUuid uuid(printableKey);
+    if (uuid.isNull()) {
+        return printableKey;
+    }
+    return uuid.toRfc4122();
+}
+
 } // namespace Akonadi2
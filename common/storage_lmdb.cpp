@@ -22,6 +22,7 @@
 #include "storage.h"
 
 #include <iostream>
+#include <cstring>
 
 #include <QAtomicInt>
 #include <QDebug>
@@ -48,6 +49,8 @@ public:
     MDB_dbi dbi;
     MDB_env *env;
     MDB_txn *transaction;
+    //Used by append within a write transaction, it is closed together with the transaction
+    MDB_cursor *appendCursor;
     AccessMode mode;
     bool readTransaction;
     bool firstOpen;
@@ -64,6 +67,7 @@ Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool
       name(n),
       env(0),
       transaction(0),
+      appendCursor(0),
       mode(m),
       readTransaction(false),
       firstOpen(true),
@@ -198,6 +202,7 @@ bool Storage::commitTransaction()
     int rc;
     rc = mdb_txn_commit(d->transaction);
     d->transaction = 0;
+    d->appendCursor = 0;
 
     if (rc) {
         std::cerr << "mdb_txn_commit: " << rc << " " << mdb_strerror(rc) << std::endl;
@@ -214,6 +219,7 @@ void Storage::abortTransaction()
 
     mdb_txn_abort(d->transaction);
     d->transaction = 0;
+    d->appendCursor = 0;
 }
 
 bool Storage::write(const void *keyPtr, size_t keySize, const void *valuePtr, size_t valueSize)
@@ -262,6 +268,162 @@ bool Storage::write(const void *keyPtr, size_t keySize, const void *valuePtr, si
     return !rc;
 }
 
+bool Storage::append(const void *keyPtr, size_t keySize, const void *valuePtr, size_t valueSize)
+{
+    if (!d->env) {
+        return false;
+    }
+
+    if (d->mode == ReadOnly) {
+        std::cerr << "tried to write in read-only mode." << std::endl;
+        return false;
+    }
+
+    if (!keyPtr || keySize == 0) {
+        std::cerr << "tried to write empty key." << std::endl;
+        return false;
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return false;
+        }
+    }
+
+    int rc = 0;
+    if (!d->appendCursor) {
+        rc = mdb_cursor_open(d->transaction, d->dbi, &d->appendCursor);
+        if (rc) {
+            std::cerr << "mdb_cursor_open: " << rc << " " << mdb_strerror(rc) << std::endl;
+            d->appendCursor = 0;
+        }
+    }
+
+    if (!rc) {
+        MDB_val key, data;
+        key.mv_size = keySize;
+        key.mv_data = const_cast<void*>(keyPtr);
+        data.mv_size = valueSize;
+        data.mv_data = const_cast<void*>(valuePtr);
+        //MDB_APPEND only accepts keys larger than the last key, further values of the last key need MDB_APPENDDUP
+        unsigned int flags = MDB_APPEND;
+        if (d->allowDuplicates) {
+            MDB_val lastKey, lastData;
+            if (!mdb_cursor_get(d->appendCursor, &lastKey, &lastData, MDB_LAST) && lastKey.mv_size == keySize && !memcmp(lastKey.mv_data, keyPtr, keySize)) {
+                flags = MDB_APPENDDUP;
+            }
+        }
+        rc = mdb_cursor_put(d->appendCursor, &key, &data, flags);
+
+        if (rc) {
+            std::cerr << "mdb_cursor_put: " << rc << " " << mdb_strerror(rc) << std::endl;
+        }
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            rc = commitTransaction();
+        }
+    }
+
+    return !rc;
+}
+
+bool Storage::removeAll()
+{
+    if (!d->env) {
+        return false;
+    }
+
+    if (d->mode == ReadOnly) {
+        std::cerr << "tried to write in read-only mode." << std::endl;
+        return false;
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return false;
+        }
+    }
+
+    //Empties the database but keeps it open
+    const int rc = mdb_drop(d->transaction, d->dbi, 0);
+
+    if (rc) {
+        std::cerr << "mdb_drop: " << rc << " " << mdb_strerror(rc) << std::endl;
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            return commitTransaction();
+        }
+    }
+
+    return !rc;
+}
+
+bool Storage::write(const void *keyPtr, size_t keySize, size_t valueSize, const std::function<void(void *valuePtr)> &writer)
+{
+    if (!d->env) {
+        return false;
+    }
+
+    if (d->mode == ReadOnly) {
+        std::cerr << "tried to write in read-only mode." << std::endl;
+        return false;
+    }
+
+    if (!keyPtr || keySize == 0) {
+        std::cerr << "tried to write empty key." << std::endl;
+        return false;
+    }
+
+    if (d->allowDuplicates) {
+        //MDB_RESERVE is not supported for MDB_DUPSORT databases
+        QByteArray value(valueSize, 0);
+        writer(value.data());
+        return write(keyPtr, keySize, value.constData(), valueSize);
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return false;
+        }
+    }
+
+    int rc;
+    MDB_val key, data;
+    key.mv_size = keySize;
+    key.mv_data = const_cast<void*>(keyPtr);
+    data.mv_size = valueSize;
+    data.mv_data = 0;
+    rc = mdb_put(d->transaction, d->dbi, &key, &data, MDB_RESERVE);
+
+    if (rc) {
+        std::cerr << "mdb_put: " << rc << " " << mdb_strerror(rc) << std::endl;
+    } else {
+        //The reserved space is only valid until the next write in this transaction
+        writer(data.mv_data);
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            rc = commitTransaction();
+        }
+    }
+
+    return !rc;
+}
+
 bool Storage::write(const std::string &sKey, const std::string &sValue)
 {
     return write(const_cast<char*>(sKey.data()), sKey.size(), const_cast<char*>(sValue.data()), sValue.size());
@@ -354,6 +516,94 @@ void Storage::scan(const char *keyData, uint keySize,
     }
 }
 
+void Storage::scanRange(const QByteArray &lower, const QByteArray &upper, bool descending,
+                        const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                        const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    if (!d->env) {
+        Error error(d->name.toStdString(), -1, "Not open");
+        errorHandler(error);
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction;
+    if (implicitTransaction) {
+        if (!startTransaction(ReadOnly)) {
+            Error error(d->name.toStdString(), -2, "Could not start transaction");
+            errorHandler(error);
+            return;
+        }
+    }
+
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    if (rc) {
+        Error error(d->name.toStdString(), rc, std::string("Error during mdb_cursor open: ") + mdb_strerror(rc));
+        errorHandler(error);
+        if (implicitTransaction) {
+            abortTransaction();
+        }
+        return;
+    }
+
+    //QByteArray compares like the default key comparison of lmdb
+    const auto keyOf = [](const MDB_val &key) {
+        return QByteArray::fromRawData(static_cast<char*>(key.mv_data), key.mv_size);
+    };
+    MDB_val key;
+    MDB_val data;
+    if (descending) {
+        if (upper.isEmpty()) {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+        } else {
+            //Position on the first key that is not smaller than upper, and step back from there
+            key.mv_data = const_cast<char*>(upper.constData());
+            key.mv_size = upper.size();
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+            if (rc == MDB_NOTFOUND) {
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+            } else if (!rc) {
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_PREV);
+            }
+        }
+        while (!rc && keyOf(key) >= lower) {
+            if (!resultHandler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+                break;
+            }
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_PREV);
+        }
+    } else {
+        if (lower.isEmpty()) {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+        } else {
+            key.mv_data = const_cast<char*>(lower.constData());
+            key.mv_size = lower.size();
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+        }
+        while (!rc && (upper.isEmpty() || keyOf(key) < upper)) {
+            if (!resultHandler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+                break;
+            }
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+    }
+    //We never find the value past the range
+    if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+
+    mdb_cursor_close(cursor);
+
+    if (rc) {
+        Error error(d->name.toStdString(), rc, std::string("Error during range scan: ") + mdb_strerror(rc));
+        errorHandler(error);
+    }
+
+    if (implicitTransaction) {
+        abortTransaction();
+    }
+}
+
 void Storage::remove(const void *keyData, uint keySize)
 {
     remove(keyData, keySize, basicErrorHandler());
@@ -404,6 +654,61 @@ void Storage::remove(const void *keyData, uint keySize, const std::function<void
     return;
 }
 
+void Storage::remove(const void *keyData, uint keySize, const void *valueData, uint valueSize,
+                     const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    if (!d->env) {
+        Error error(d->name.toStdString(), -1, "Not open");
+        errorHandler(error);
+        return;
+    }
+
+    if (d->mode == ReadOnly) {
+        Error error(d->name.toStdString(), -3, "Tried to write in read-only mode");
+        errorHandler(error);
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            Error error(d->name.toStdString(), -2, "Could not start transaction");
+            errorHandler(error);
+            return;
+        }
+    }
+
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    if (!rc) {
+        MDB_val key;
+        key.mv_size = keySize;
+        key.mv_data = const_cast<void*>(keyData);
+        MDB_val data;
+        data.mv_size = valueSize;
+        data.mv_data = const_cast<void*>(valueData);
+        //Positions the cursor on the exact key/value pair, so only this duplicate is deleted
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_GET_BOTH);
+        if (!rc) {
+            rc = mdb_cursor_del(cursor, 0);
+        }
+        mdb_cursor_close(cursor);
+    }
+
+    if (rc) {
+        Error error(d->name.toStdString(), rc, QString("Error on mdb_cursor_del: %1 %2").arg(rc).arg(mdb_strerror(rc)).toStdString());
+        errorHandler(error);
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            commitTransaction();
+        }
+    }
+}
+
 qint64 Storage::diskUsage() const
 {
     QFileInfo info(d->storageRoot + '/' + d->name + "/data.mdb");
@@ -28,6 +28,8 @@
 #include <QReadWriteLock>
 #include <QString>
 #include <QTime>
+#include <QVector>
+#include <algorithm>
 
 extern "C" {
     #include "unqlite/unqlite.h"
@@ -206,6 +208,37 @@ bool Storage::write(const void *key, size_t keySize, const void *value, size_t v
     return !rc;
 }
 
+bool Storage::write(const void *key, size_t keySize, size_t valueSize, const std::function<void(void *valuePtr)> &writer)
+{
+    //unqlite has no way to reserve space, so we assemble the value in memory
+    QByteArray value(valueSize, 0);
+    writer(value.data());
+    return write(key, keySize, value.constData(), valueSize);
+}
+
+bool Storage::append(const void *key, size_t keySize, const void *value, size_t valueSize)
+{
+    //unqlite doesn't keep the keys ordered, so there is nothing to gain
+    return write(key, keySize, value, valueSize);
+}
+
+bool Storage::removeAll()
+{
+    if (!d->db) {
+        return false;
+    }
+
+    QVector<QByteArray> keys;
+    scan(nullptr, 0, [&keys](void *keyPtr, int keySize, void *, int) -> bool {
+        keys << QByteArray(static_cast<char*>(keyPtr), keySize);
+        return true;
+    }, basicErrorHandler());
+    for (const auto &key : keys) {
+        unqlite_kv_delete(d->db, key.constData(), key.size());
+    }
+    return true;
+}
+
 bool Storage::write(const std::string &sKey, const std::string &sValue)
 {
     return write(sKey.data(), sKey.size(), sValue.data(), sKey.size());
@@ -252,6 +285,23 @@ void Storage::remove(const void *keyData, uint keySize,
     unqlite_kv_delete(d->db, keyData, keySize);
 }
 
+void Storage::remove(const void *keyData, uint keySize, const void *valueData, uint valueSize,
+                     const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    //unqlite doesn't support duplicates, so there is at most one value to remove
+    bool matches = false;
+    scan(static_cast<const char *>(keyData), keySize, [&](void *, int, void *valuePtr, int size) -> bool {
+        matches = QByteArray::fromRawData(static_cast<char*>(valuePtr), size) == QByteArray::fromRawData(static_cast<const char*>(valueData), valueSize);
+        return false;
+    }, errorHandler);
+    if (!matches) {
+        Error error(d->name.toStdString(), -1, "Value not found");
+        errorHandler(error);
+        return;
+    }
+    remove(keyData, keySize, errorHandler);
+}
+
 
 void fetchCursorData(unqlite_kv_cursor *cursor,
                      void **keyBuffer, int *keyBufferLength, void **dataBuffer, unqlite_int64 *dataBufferLength,
@@ -321,6 +371,30 @@ void Storage::scan(const char *keyData, uint keySize,
     unqlite_kv_cursor_release(d->db, cursor);
 }
 
+void Storage::scanRange(const QByteArray &lower, const QByteArray &upper, bool descending,
+                        const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                        const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    //unqlite doesn't keep the keys ordered, so the matching values are collected and sorted
+    QVector<QPair<QByteArray, QByteArray> > values;
+    scan(nullptr, 0, [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        const QByteArray key(static_cast<char*>(keyPtr), keySize);
+        if (key >= lower && (upper.isEmpty() || key < upper)) {
+            values << qMakePair(key, QByteArray(static_cast<char*>(valuePtr), valueSize));
+        }
+        return true;
+    }, errorHandler);
+    std::sort(values.begin(), values.end());
+    if (descending) {
+        std::reverse(values.begin(), values.end());
+    }
+    for (auto &value : values) {
+        if (!resultHandler(value.first.data(), value.first.size(), value.second.data(), value.second.size())) {
+            break;
+        }
+    }
+}
+
 qint64 Storage::diskUsage() const
 {
     QFileInfo info(d->storageRoot + s_unqliteDir + d->name);
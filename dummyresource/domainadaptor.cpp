@@ -2,6 +2,7 @@
 #include "domainadaptor.h"
 
 #include <QDebug>
+#include <QDateTime>
 #include <functional>
 
 #include "dummycalendar_generated.h"
@@ -73,6 +74,18 @@ DummyEventAdaptorFactory::DummyEventAdaptorFactory()
         }
         return QVariant();
     });
+    mResourceMapper->mReadAccessors.insert("description", [](DummyEvent const *buffer) -> QVariant {
+        if (buffer->description()) {
+            return QString::fromStdString(buffer->description()->c_str());
+        }
+        return QVariant();
+    });
+    mResourceMapper->mReadAccessors.insert("remoteId", [](DummyEvent const *buffer) -> QVariant {
+        if (buffer->remoteId()) {
+            return QString::fromStdString(buffer->remoteId()->c_str());
+        }
+        return QVariant();
+    });
     mLocalMapper = QSharedPointer<PropertyMapper<Akonadi2::Domain::Buffer::Event> >::create();
     mLocalMapper->mReadAccessors.insert("summary", [](Akonadi2::Domain::Buffer::Event const *buffer) -> QVariant {
         if (buffer->summary()) {
@@ -86,35 +99,63 @@ DummyEventAdaptorFactory::DummyEventAdaptorFactory()
         }
         return QVariant();
     });
+    mLocalMapper->mReadAccessors.insert("startTime", [](Akonadi2::Domain::Buffer::Event const *buffer) -> QVariant {
+        if (buffer->startTime()) {
+            return QDateTime::fromMSecsSinceEpoch(buffer->startTime());
+        }
+        return QVariant();
+    });
+    mLocalMapper->mReadAccessors.insert("endTime", [](Akonadi2::Domain::Buffer::Event const *buffer) -> QVariant {
+        if (buffer->endTime()) {
+            return QDateTime::fromMSecsSinceEpoch(buffer->endTime());
+        }
+        return QVariant();
+    });
+}
 
+QList<QList<QByteArray> > DummyEventAdaptorFactory::indexes()
+{
+    //Composite indexes answer equality filters on the leading properties, optionally followed by a range filter
+    return QList<QList<QByteArray> >()
+        << (QList<QByteArray>() << "uid")
+        << (QList<QByteArray>() << "summary" << "startTime")
+        << (QList<QByteArray>() << "startTime")
+        << (QList<QByteArray>() << "remoteId");
 }
 
-//TODO pass EntityBuffer instead?
-QSharedPointer<Akonadi2::Domain::BufferAdaptor> DummyEventAdaptorFactory::createAdaptor(const Akonadi2::Entity &entity)
+QList<QByteArray> DummyEventAdaptorFactory::fullTextProperties()
 {
-    DummyEvent const *resourceBuffer = 0;
-    if (auto resourceData = entity.resource()) {
-        flatbuffers::Verifier verifyer(resourceData->Data(), resourceData->size());
-        if (VerifyDummyEventBuffer(verifyer)) {
-            resourceBuffer = GetDummyEvent(resourceData->Data());
-        }
-    }
+    return QList<QByteArray>() << "summary" << "description";
+}
 
-    Akonadi2::Metadata const *metadataBuffer = 0;
-    if (auto metadataData = entity.metadata()) {
-        flatbuffers::Verifier verifyer(metadataData->Data(), metadataData->size());
-        if (Akonadi2::VerifyMetadataBuffer(verifyer)) {
-            metadataBuffer = Akonadi2::GetMetadata(metadataData->Data());
-        }
-    }
+QList<QByteArray> DummyEventAdaptorFactory::bloomFilterIndexes()
+{
+    return QList<QByteArray>() << "uid" << "remoteId";
+}
 
-    Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
-    if (auto localData = entity.local()) {
-        flatbuffers::Verifier verifyer(localData->Data(), localData->size());
-        if (Akonadi2::Domain::Buffer::VerifyEventBuffer(verifyer)) {
-            localBuffer = Akonadi2::Domain::Buffer::GetEvent(localData->Data());
-        }
+QList<QPair<QByteArray, QByteArray> > DummyEventAdaptorFactory::intervalIndexes()
+{
+    return QList<QPair<QByteArray, QByteArray> >() << qMakePair(QByteArray("startTime"), QByteArray("endTime"));
+}
+
+bool DummyEventAdaptorFactory::verifyBuffers(const Akonadi2::Entity &entity)
+{
+    //Both buffers are optional, but if they are there they have to be valid
+    if (entity.resource() && !Akonadi2::EntityBuffer::readBuffer<DummyEvent>(entity.resource(), VerifyDummyEventBuffer)) {
+        return false;
     }
+    if (entity.local() && !Akonadi2::EntityBuffer::readBuffer<Akonadi2::Domain::Buffer::Event>(entity.local(), Akonadi2::Domain::Buffer::VerifyEventBuffer)) {
+        return false;
+    }
+    return true;
+}
+
+//TODO pass EntityBuffer instead?
+QSharedPointer<Akonadi2::Domain::BufferAdaptor> DummyEventAdaptorFactory::createAdaptor(const Akonadi2::Entity &entity)
+{
+    //Adaptors are only created for entities from our storage, which have been verified by the pipeline
+    const auto resourceBuffer = Akonadi2::EntityBuffer::readBuffer<DummyEvent>(entity.resource(), VerifyDummyEventBuffer, Akonadi2::EntityBuffer::Trusted);
+    const auto localBuffer = Akonadi2::EntityBuffer::readBuffer<Akonadi2::Domain::Buffer::Event>(entity.local(), Akonadi2::Domain::Buffer::VerifyEventBuffer, Akonadi2::EntityBuffer::Trusted);
 
     auto adaptor = QSharedPointer<DummyEventAdaptor>::create();
     adaptor->mLocalBuffer = localBuffer;
@@ -124,23 +165,48 @@ QSharedPointer<Akonadi2::Domain::BufferAdaptor> DummyEventAdaptorFactory::create
     return adaptor;
 }
 
-void DummyEventAdaptorFactory::createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb)
+void DummyEventAdaptorFactory::createBuffer(const Akonadi2::Domain::AkonadiDomainType &event, flatbuffers::FlatBufferBuilder &fbb)
 {
+    //Unset properties are left out, so the buffer can also be used as delta for modifications
     flatbuffers::FlatBufferBuilder eventFbb;
     eventFbb.Clear();
     {
-        auto summary = eventFbb.CreateString(event.getProperty("summary").toString().toStdString());
+        const auto summaryValue = event.getProperty("summary");
+        const auto descriptionValue = event.getProperty("description");
+        const auto remoteIdValue = event.getProperty("remoteId");
+        auto summary = eventFbb.CreateString(summaryValue.toString().toStdString());
+        auto description = eventFbb.CreateString(descriptionValue.toString().toStdString());
+        auto remoteId = eventFbb.CreateString(remoteIdValue.toString().toStdString());
         DummyCalendar::DummyEventBuilder eventBuilder(eventFbb);
-        eventBuilder.add_summary(summary);
+        if (summaryValue.isValid()) {
+            eventBuilder.add_summary(summary);
+        }
+        if (descriptionValue.isValid()) {
+            eventBuilder.add_description(description);
+        }
+        if (remoteIdValue.isValid()) {
+            eventBuilder.add_remoteId(remoteId);
+        }
         auto eventLocation = eventBuilder.Finish();
         DummyCalendar::FinishDummyEventBuffer(eventFbb, eventLocation);
     }
 
     flatbuffers::FlatBufferBuilder localFbb;
     {
-        auto uid = localFbb.CreateString(event.getProperty("uid").toString().toStdString());
+        const auto uidValue = event.getProperty("uid");
+        auto uid = localFbb.CreateString(uidValue.toString().toStdString());
+        const auto startTime = event.getProperty("startTime").toDateTime();
+        const auto endTime = event.getProperty("endTime").toDateTime();
         auto localBuilder = Akonadi2::Domain::Buffer::EventBuilder(localFbb);
-        localBuilder.add_uid(uid);
+        if (uidValue.isValid()) {
+            localBuilder.add_uid(uid);
+        }
+        if (startTime.isValid()) {
+            localBuilder.add_startTime(startTime.toMSecsSinceEpoch());
+        }
+        if (endTime.isValid()) {
+            localBuilder.add_endTime(endTime.toMSecsSinceEpoch());
+        }
         auto location = localBuilder.Finish();
         Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, location);
     }
@@ -11,5 +11,15 @@ class DummyEventAdaptorFactory : public DomainTypeAdaptorFactory<Akonadi2::Domai
 public:
     DummyEventAdaptorFactory();
     virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity);
-    virtual void createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb);
+    virtual void createBuffer(const Akonadi2::Domain::AkonadiDomainType &event, flatbuffers::FlatBufferBuilder &fbb);
+    virtual bool verifyBuffers(const Akonadi2::Entity &entity);
+
+    //The properties of each secondary index that is maintained for events
+    static QList<QList<QByteArray> > indexes();
+    //The start and end properties of each interval index
+    static QList<QPair<QByteArray, QByteArray> > intervalIndexes();
+    //The properties whose words are in the full-text index
+    static QList<QByteArray> fullTextProperties();
+    //Indexes that are mostly looked up by exact key, often of entities that don't exist yet
+    static QList<QByteArray> bloomFilterIndexes();
 };
@@ -21,6 +21,7 @@
 
 #include <QDebug>
 #include <functional>
+#include <algorithm>
 
 #include "common/resourceaccess.h"
 #include "common/commands.h"
@@ -29,6 +30,8 @@
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deleteentity_generated.h"
 #include "domainadaptor.h"
 #include <common/entitybuffer.h>
 #include <common/index.h>
@@ -39,8 +42,20 @@ using namespace flatbuffers;
 DummyResourceFacade::DummyResourceFacade()
     : Akonadi2::StoreFacade<Akonadi2::Domain::Event>(),
     mResourceAccess(new Akonadi2::ResourceAccess("org.kde.dummy")),
-    mFactory(new DummyEventAdaptorFactory)
+    mFactory(new DummyEventAdaptorFactory),
+    //Opt-in because it requires write access to the resource storage (i.e. for bulk imports)
+    mDirectEnqueue(qgetenv("AKONADI2_DIRECT_ENQUEUE") == "1"),
+    mPlanner([this](const QString &name) { return index(name); }),
+    //Logs the plan of every query
+    mExplain(qgetenv("AKONADI2_EXPLAIN_QUERIES") == "1")
 {
+    for (const auto &properties : DummyEventAdaptorFactory::indexes()) {
+        mPlanner.addIndex(properties);
+    }
+    for (const auto &interval : DummyEventAdaptorFactory::intervalIndexes()) {
+        mPlanner.addIntervalIndex(interval.first, interval.second);
+    }
+    mPlanner.setFullTextIndex("fulltext");
 }
 
 DummyResourceFacade::~DummyResourceFacade()
@@ -59,60 +74,177 @@ Async::Job<void> DummyResourceFacade::create(const Akonadi2::Domain::Event &doma
     auto location = Akonadi2::Commands::CreateCreateEntity(fbb, type, delta);
     Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
     mResourceAccess->open();
+    if (mDirectEnqueue) {
+        return mResourceAccess->enqueueCommand(Akonadi2::Commands::CreateEntityCommand, fbb);
+    }
     return mResourceAccess->sendCommand(Akonadi2::Commands::CreateEntityCommand, fbb);
 }
 
 Async::Job<void> DummyResourceFacade::modify(const Akonadi2::Domain::Event &domainObject)
 {
-    //Create message buffer and send to resource
-    return Async::null<void>();
+    //The delta only contains the changed properties, the resource merges it with the stored entity
+    auto changes = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create();
+    QStringList deletedProperties;
+    for (const auto &property : domainObject.changedProperties()) {
+        const auto value = domainObject.getProperty(property);
+        if (value.isValid()) {
+            changes->setProperty(property, value);
+        } else {
+            deletedProperties << property;
+        }
+    }
+    flatbuffers::FlatBufferBuilder entityFbb;
+    mFactory->createBuffer(Akonadi2::Domain::Event(QString(), domainObject.identifier(), domainObject.revision(), changes), entityFbb);
+
+    flatbuffers::FlatBufferBuilder fbb;
+    auto entityId = fbb.CreateString(domainObject.identifier().toStdString());
+    std::vector<flatbuffers::Offset<flatbuffers::String> > deletions;
+    for (const auto &property : deletedProperties) {
+        deletions.push_back(fbb.CreateString(property.toStdString()));
+    }
+    auto deletionList = fbb.CreateVector(deletions);
+    //This is the resource buffer type and not the domain type
+    auto type = fbb.CreateString("event");
+    auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
+    auto location = Akonadi2::CreateModifyEntity(fbb, domainObject.revision(), entityId, deletionList, type, delta);
+    Akonadi2::FinishModifyEntityBuffer(fbb, location);
+    mResourceAccess->open();
+    if (mDirectEnqueue) {
+        return mResourceAccess->enqueueCommand(Akonadi2::Commands::ModifyEntityCommand, fbb);
+    }
+    return mResourceAccess->sendCommand(Akonadi2::Commands::ModifyEntityCommand, fbb);
 }
 
 Async::Job<void> DummyResourceFacade::remove(const Akonadi2::Domain::Event &domainObject)
 {
-    //Create message buffer and send to resource
-    return Async::null<void>();
+    flatbuffers::FlatBufferBuilder fbb;
+    auto entityId = fbb.CreateString(domainObject.identifier().toStdString());
+    //This is the resource buffer type and not the domain type
+    auto type = fbb.CreateString("event");
+    auto location = Akonadi2::CreateDeleteEntity(fbb, domainObject.revision(), entityId, type);
+    Akonadi2::FinishDeleteEntityBuffer(fbb, location);
+    mResourceAccess->open();
+    if (mDirectEnqueue) {
+        return mResourceAccess->enqueueCommand(Akonadi2::Commands::DeleteEntityCommand, fbb);
+    }
+    return mResourceAccess->sendCommand(Akonadi2::Commands::DeleteEntityCommand, fbb);
+}
+
+//Compares in index order, so the filter agrees with the index lookups
+static bool inRange(const QVariant &value, const Akonadi2::Query::Range &range)
+{
+    if (!value.isValid()) {
+        return false;
+    }
+    const auto encoded = Index::encodeValue(value);
+    if (range.lower.isValid() && encoded < Index::encodeValue(range.lower)) {
+        return false;
+    }
+    if (range.upper.isValid() && encoded > Index::encodeValue(range.upper)) {
+        return false;
+    }
+    return true;
 }
 
-static std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> prepareQuery(const Akonadi2::Query &query)
+static bool overlaps(const Akonadi2::Domain::BufferAdaptor &properties, const Akonadi2::Query::Overlap &overlap)
+{
+    const auto start = properties.getProperty(overlap.startProperty);
+    if (!start.isValid()) {
+        return false;
+    }
+    const auto encodedStart = Index::encodeValue(start);
+    auto encodedEnd = Index::encodeValue(properties.getProperty(overlap.endProperty));
+    if (encodedEnd.isEmpty() || encodedEnd < encodedStart) {
+        encodedEnd = encodedStart;
+    }
+    if (overlap.range.lower.isValid() && encodedEnd < Index::encodeValue(overlap.range.lower)) {
+        return false;
+    }
+    if (overlap.range.upper.isValid() && encodedStart > Index::encodeValue(overlap.range.upper)) {
+        return false;
+    }
+    return true;
+}
+
+static bool containsTerms(const Akonadi2::Domain::BufferAdaptor &properties, const QList<QPair<QString, bool> > &terms)
+{
+    QStringList tokens;
+    for (const auto &property : DummyEventAdaptorFactory::fullTextProperties()) {
+        tokens << Index::tokenize(properties.getProperty(QString::fromLatin1(property)).toString());
+    }
+    for (const auto &term : terms) {
+        bool found = false;
+        for (const auto &token : tokens) {
+            if (term.second ? token.startsWith(term.first) : token == term.first) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static DummyResourceFacade::Predicate prepareQuery(const Akonadi2::Query &query)
 {
     //Compose some functions to make query matching fast.
     //This way we can process the query once, and convert all values into something that can be compared quickly
-    std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> preparedQuery;
-    if (!query.ids.isEmpty()) {
-        //Match by id
-        //TODO: for id's a direct lookup would be way faster
-
-        //We convert the id's to std::string so we don't have to convert each key during the scan. (This runs only once, and the query will be run for every key)
-        //Probably a premature optimization, but perhaps a useful technique to be investigated.
-        QVector<std::string> ids;
-        for (const auto &id : query.ids) {
-            ids << id.toStdString();
-        }
-        preparedQuery = [ids](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-            if (ids.contains(key)) {
-                return true;
-            }
+    //TODO: for id's a direct lookup would be way faster
+
+    //We convert the id's to std::string so we don't have to convert each key during the scan. (This runs only once, and the query will be run for every key)
+    //Probably a premature optimization, but perhaps a useful technique to be investigated.
+    //Entities created before binary keys were introduced are still stored with their printable key.
+    QVector<std::string> ids;
+    for (const auto &id : query.ids) {
+        ids << id.toStdString();
+        ids << Akonadi2::Storage::entityKey(id.toUtf8()).toStdString();
+    }
+    const auto propertyFilter = query.propertyFilter;
+    const auto rangeFilter = query.rangeFilter;
+    const auto overlapFilter = query.overlapFilter;
+    const auto textTerms = QueryPlanner::parseTextSearch(query.textSearch);
+    //Index lookups only narrow down the candidates, so all filters are checked on every value
+    return [ids, propertyFilter, rangeFilter, overlapFilter, textTerms](const std::string &key, const Akonadi2::Domain::BufferAdaptor &properties) -> bool {
+        if (!ids.isEmpty() && !ids.contains(key)) {
             return false;
-        };
-    } else if (!query.propertyFilter.isEmpty()) {
-        if (query.propertyFilter.contains("uid")) {
-            const QByteArray uid = query.propertyFilter.value("uid").toByteArray();
-            preparedQuery = [uid](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-                if (local && local->uid() && (QByteArray::fromRawData(local->uid()->c_str(), local->uid()->size()) == uid)) {
-                    qDebug() << "uid match";
-                    return true;
-                }
+        }
+        for (auto it = propertyFilter.constBegin(); it != propertyFilter.constEnd(); ++it) {
+            if (!QueryPlanner::filterValues(it.value()).contains(properties.getProperty(it.key()))) {
                 return false;
-            };
+            }
         }
-    } else {
-        //Match everything
-        preparedQuery = [](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-            return true;
-        };
+        for (auto it = rangeFilter.constBegin(); it != rangeFilter.constEnd(); ++it) {
+            if (!inRange(properties.getProperty(it.key()), it.value())) {
+                return false;
+            }
+        }
+        if (!overlapFilter.startProperty.isEmpty() && !overlaps(properties, overlapFilter)) {
+            return false;
+        }
+        if (!textTerms.isEmpty() && !containsTerms(properties, textTerms)) {
+            return false;
+        }
+        return true;
+    };
+}
+
+QSharedPointer<Index> DummyResourceFacade::index(const QString &name)
+{
+    auto index = mIndexes.value(name);
+    if (!index) {
+        index = QSharedPointer<Index>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy.index." + name, Akonadi2::Storage::ReadOnly);
+        if (!index->exists()) {
+            //The index may not have been created yet, so we try to open it again next time
+            return QSharedPointer<Index>();
+        }
+        if (DummyEventAdaptorFactory::bloomFilterIndexes().contains(name.toLatin1())) {
+            index->enableBloomFilter();
+        }
+        mIndexes.insert(name, index);
     }
-    return preparedQuery;
+    return index;
 }
 
 Async::Job<void> DummyResourceFacade::synchronizeResource(bool sync, bool processAll)
@@ -133,8 +265,9 @@ Async::Job<void> DummyResourceFacade::synchronizeResource(bool sync, bool proces
     return Async::null<void>();
 }
 
-void DummyResourceFacade::readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> preparedQuery)
+bool DummyResourceFacade::readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<bool(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const Predicate &preparedQuery)
 {
+    bool stopped = false;
     storage->scan(key.data(), key.size(), [=](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
 
         //Skip internals
@@ -142,55 +275,45 @@ void DummyResourceFacade::readValue(QSharedPointer<Akonadi2::Storage> storage, c
             return true;
         }
 
-        //Extract buffers
-        Akonadi2::EntityBuffer buffer(dataValue, dataSize);
-
-        DummyEvent const *resourceBuffer = 0;
-        if (auto resourceData = buffer.entity().resource()) {
-            flatbuffers::Verifier verifyer(resourceData->Data(), resourceData->size());
-            if (VerifyDummyEventBuffer(verifyer)) {
-                resourceBuffer = GetDummyEvent(resourceData->Data());
-            }
-        }
-
-        Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
-        if (auto localData = buffer.entity().local()) {
-            flatbuffers::Verifier verifyer(localData->Data(), localData->size());
-            if (Akonadi2::Domain::Buffer::VerifyEventBuffer(verifyer)) {
-                localBuffer = Akonadi2::Domain::Buffer::GetEvent(localData->Data());
-            }
+        //Extract buffers, the pipeline verified them before they were written
+        Akonadi2::EntityBuffer buffer(dataValue, dataSize, Akonadi2::EntityBuffer::Trusted);
+        if (!buffer.isValid()) {
+            return true;
         }
 
-        Akonadi2::Metadata const *metadataBuffer = 0;
-        if (auto metadataData = buffer.entity().metadata()) {
-            flatbuffers::Verifier verifyer(metadataData->Data(), metadataData->size());
-            if (Akonadi2::VerifyMetadataBuffer(verifyer)) {
-                metadataBuffer = Akonadi2::GetMetadata(metadataData->Data());
-            }
-        }
+        const auto resourceBuffer = Akonadi2::EntityBuffer::readBuffer<DummyEvent>(buffer.entity().resource(), VerifyDummyEventBuffer, Akonadi2::EntityBuffer::Trusted);
+        const auto metadataBuffer = Akonadi2::EntityBuffer::readBuffer<Akonadi2::Metadata>(buffer.entity().metadata(), Akonadi2::VerifyMetadataBuffer, Akonadi2::EntityBuffer::Trusted);
 
         if (!resourceBuffer || !metadataBuffer) {
-            qWarning() << "invalid buffer " << QString::fromStdString(std::string(static_cast<char*>(keyValue), keySize));
+            qWarning() << "invalid buffer " << Akonadi2::Storage::printableKey(QByteArray::fromRawData(static_cast<char*>(keyValue), keySize));
+            return true;
+        }
+        //Deleted entities remain as tombstone until they are garbage collected
+        if (metadataBuffer->deleted()) {
             return true;
         }
 
-        //We probably only want to create all buffers after the scan
-        //TODO use adapter for query and scan?
-        if (preparedQuery && preparedQuery(std::string(static_cast<char*>(keyValue), keySize), resourceBuffer, localBuffer)) {
+        //This only works for a 1:1 mapping of resource to domain types.
+        //Not i.e. for tags that are stored as flags in each entity of an imap store.
+        auto adaptor = mFactory->createAdaptor(buffer.entity());
+        if (preparedQuery && preparedQuery(std::string(static_cast<char*>(keyValue), keySize), *adaptor)) {
             qint64 revision = metadataBuffer ? metadataBuffer->revision() : -1;
-            //This only works for a 1:1 mapping of resource to domain types.
-            //Not i.e. for tags that are stored as flags in each entity of an imap store.
-            auto adaptor = mFactory->createAdaptor(buffer.entity());
             //TODO only copy requested properties
             auto memoryAdaptor = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create(*adaptor);
-            auto event = QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString::fromUtf8(static_cast<char*>(keyValue), keySize), revision, memoryAdaptor);
-            resultCallback(event);
+            //Keys are only converted to their printable form at the API boundary
+            const auto identifier = Akonadi2::Storage::printableKey(QByteArray(static_cast<char*>(keyValue), keySize));
+            auto event = QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString::fromUtf8(identifier), revision, memoryAdaptor);
+            if (!resultCallback(event)) {
+                stopped = true;
+                return false;
+            }
         }
         return true;
     },
     [](const Akonadi2::Storage::Error &error) {
         qWarning() << "Error during query: " << QString::fromStdString(error.message);
     });
+    return !stopped;
 }
 
 Async::Job<void> DummyResourceFacade::load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback)
@@ -201,26 +324,62 @@ Async::Job<void> DummyResourceFacade::load(const Akonadi2::Query &query, const s
 
         auto storage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
 
-        QVector<QByteArray> keys;
-        if (query.propertyFilter.contains("uid")) {
-            static Index uidIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.uid", Akonadi2::Storage::ReadOnly);
-            uidIndex.lookup(query.propertyFilter.value("uid").toByteArray(), [&](const QByteArray &value) {
-                keys << value;
-            },
-            [](const Index::Error &error) {
-                qWarning() << "Error in index: " <<  QString::fromStdString(error.message);
-            });
-        }
-
         //We start a transaction explicitly that we'll leave open so the values can be read.
         //The transaction will be closed automatically once the storage object is destroyed.
         storage->startTransaction(Akonadi2::Storage::ReadOnly);
-        if (keys.isEmpty()) {
+
+        const auto plan = mPlanner.plan(query);
+        if (mExplain) {
+            qDebug() << "Query plan:" << QueryPlanner::explain(plan);
+        }
+        //Unless the plan returns the values in order, results are collected and sorted before the limit applies
+        bool sorted = plan.sorted;
+        QVector<QPair<QByteArray, Akonadi2::Domain::Event::Ptr> > results;
+        int count = 0;
+        const std::function<bool(const Akonadi2::Domain::Event::Ptr &)> collect = [&](const Akonadi2::Domain::Event::Ptr &event) -> bool {
+            if (!sorted) {
+                //Values are prefixed so only entities without the property have an empty key, which is sorted last
+                const auto value = event->getProperty(query.sortProperty);
+                results << qMakePair(value.isValid() ? '\x01' + Index::encodeValue(value) : QByteArray(), event);
+                return true;
+            }
+            if (query.limit > 0 && count >= query.limit) {
+                return false;
+            }
+            resultCallback(event);
+            count++;
+            return query.limit <= 0 || count < query.limit;
+        };
+
+        const bool indexed = mPlanner.execute(plan, [&](const QByteArray &key) -> bool {
+            return readValue(storage, key, collect, preparedQuery);
+        });
+        if (!indexed) {
+            //Nothing has been read yet, but the scan isn't ordered anymore
+            sorted = query.sortProperty.isEmpty();
             qDebug() << "full scan";
-            readValue(storage, QByteArray(), resultCallback, preparedQuery);
-        } else {
-            for (const auto &key : keys) {
-                readValue(storage, key, resultCallback, preparedQuery);
+            readValue(storage, QByteArray(), collect, preparedQuery);
+        } else if (!plan.paths.isEmpty() && plan.paths.first().ordered && (query.limit <= 0 || count < query.limit)
+                   && !query.propertyFilter.contains(query.sortProperty) && !query.rangeFilter.contains(query.sortProperty)) {
+            //The ordered index doesn't contain the entities without the sort property, which follow all others
+            readValue(storage, QByteArray(), [&](const Akonadi2::Domain::Event::Ptr &event) -> bool {
+                return event->getProperty(query.sortProperty).isValid() || collect(event);
+            }, preparedQuery);
+        }
+
+        if (!sorted) {
+            std::stable_sort(results.begin(), results.end(), [&query](const QPair<QByteArray, Akonadi2::Domain::Event::Ptr> &left, const QPair<QByteArray, Akonadi2::Domain::Event::Ptr> &right) {
+                if (left.first.isEmpty() || right.first.isEmpty()) {
+                    return right.first.isEmpty() && !left.first.isEmpty();
+                }
+                return query.sortDescending ? left.first > right.first : left.first < right.first;
+            });
+            for (const auto &result : results) {
+                if (query.limit > 0 && count >= query.limit) {
+                    break;
+                }
+                resultCallback(result.second);
+                count++;
             }
         }
         future.setFinished();
@@ -26,10 +26,12 @@
 #include "event_generated.h"
 #include "dummycalendar_generated.h"
 #include "common/domainadaptor.h"
+#include "common/queryplanner.h"
 
 namespace Akonadi2 {
     class ResourceAccess;
 }
+class Index;
 
 
 class DummyResourceFacade : public Akonadi2::StoreFacade<Akonadi2::Domain::Event>
@@ -42,9 +44,18 @@ public:
     virtual Async::Job<void> remove(const Akonadi2::Domain::Event &domainObject);
     virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback);
 
+    typedef std::function<bool(const std::string &key, const Akonadi2::Domain::BufferAdaptor &properties)> Predicate;
+
 private:
-    void readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, std::function<bool(const std::string &key, DummyCalendar::DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)>);
+    //Return false from the result callback to stop reading. Returns false if reading was stopped.
+    bool readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<bool(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const Predicate &preparedQuery);
+    //Returns a null pointer if the index doesn't exist yet
+    QSharedPointer<Index> index(const QString &name);
     Async::Job<void> synchronizeResource(bool sync, bool processAll);
     QSharedPointer<Akonadi2::ResourceAccess> mResourceAccess;
     QSharedPointer<DomainTypeAdaptorFactory<Akonadi2::Domain::Event, Akonadi2::Domain::Buffer::Event, DummyCalendar::DummyEvent> > mFactory;
+    bool mDirectEnqueue;
+    QHash<QString, QSharedPointer<Index> > mIndexes;
+    QueryPlanner mPlanner;
+    bool mExplain;
 };
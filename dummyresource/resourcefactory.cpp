@@ -25,11 +25,15 @@
 #include "metadata_generated.h"
 #include "queuedcommand_generated.h"
 #include "createentity_generated.h"
+#include "clientqueueupdate_generated.h"
+#include "deadletters_generated.h"
 #include "domainadaptor.h"
 #include "commands.h"
 #include "clientapi.h"
 #include "index.h"
 #include <QUuid>
+#include <QDateTime>
+#include <QSet>
 #include <assert.h>
 
 
@@ -41,33 +45,210 @@
  * ** $ISSPAM should become part of domain object and is written to the local part of the mail. 
  * ** => value could be calculated by the server directly
  */
-class SimpleProcessor : public Akonadi2::Preprocessor
+
+//Maintains the index from the values of one or more properties to the keys of the entities with those values
+class PropertyIndexer : public Akonadi2::ConcurrentPreprocessor
 {
 public:
-    SimpleProcessor(const QString &id, const std::function<void(const Akonadi2::PipelineState &state, const Akonadi2::Entity &e)> &f)
-        : Akonadi2::Preprocessor(),
-        mFunction(f),
-        mId(id)
+    PropertyIndexer(Akonadi2::Pipeline *pipeline, const DomainTypeAdaptorFactoryInterface::Ptr &factory, const QList<QByteArray> &properties)
+        : Akonadi2::ConcurrentPreprocessor(),
+        mPipeline(pipeline),
+        mFactory(factory),
+        mProperties(properties)
     {
+        QList<QByteArray> names = properties;
+        mName = QString::fromLatin1(names.takeFirst());
+        for (const auto &property : names) {
+            mName += "." + QString::fromLatin1(property);
+        }
     }
 
-    void process(const Akonadi2::PipelineState &state, const Akonadi2::Entity &e) Q_DECL_OVERRIDE
+    std::function<void()> processConcurrently(const QByteArray &key, const Akonadi2::Entity &e) Q_DECL_OVERRIDE
     {
-        mFunction(state, e);
-        processingCompleted(state);
+        const auto value = indexKey(e);
+        if (value.isEmpty()) {
+            return std::function<void()>();
+        }
+        //Written in the index transaction of the pipeline
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        const QString name = mName;
+        return [pipeline, name, value, key]() {
+            pipeline->index(name).add(value, key);
+        };
+    }
+
+    std::function<void()> processModificationConcurrently(const QByteArray &key, const Akonadi2::Entity &oldEntity, const Akonadi2::Entity &newEntity) Q_DECL_OVERRIDE
+    {
+        const auto oldValue = indexKey(oldEntity);
+        const auto newValue = indexKey(newEntity);
+        if (oldValue == newValue) {
+            return std::function<void()>();
+        }
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        const QString name = mName;
+        return [pipeline, name, oldValue, newValue, key]() {
+            auto &index = pipeline->index(name);
+            if (oldValue.isEmpty()) {
+                index.add(newValue, key);
+            } else if (newValue.isEmpty()) {
+                index.remove(oldValue, key);
+            } else {
+                index.replace(oldValue, newValue, key);
+            }
+        };
+    }
+
+    std::function<void()> processRemovalConcurrently(const QByteArray &key, const Akonadi2::Entity &e) Q_DECL_OVERRIDE
+    {
+        const auto value = indexKey(e);
+        if (value.isEmpty()) {
+            return std::function<void()>();
+        }
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        const QString name = mName;
+        return [pipeline, name, value, key]() {
+            pipeline->index(name).remove(value, key);
+        };
     }
 
     QString id() const
     {
-        return mId;
+        return mName + "Indexer";
+    }
+
+    QStringList writtenIndexes() const Q_DECL_OVERRIDE
+    {
+        return QStringList() << mName;
+    }
+
+    QList<QByteArray> readProperties() const Q_DECL_OVERRIDE
+    {
+        return mProperties;
     }
 
 protected:
-    std::function<void(const Akonadi2::PipelineState &state, const Akonadi2::Entity &e)> mFunction;
-    QString mId;
+    //Entities that lack one of the properties are not indexed
+    virtual QByteArray indexKey(const Akonadi2::Entity &e) const
+    {
+        const auto adaptor = mFactory->createAdaptor(e);
+        QVariantList values;
+        for (const auto &property : mProperties) {
+            const auto value = adaptor->getProperty(QString::fromLatin1(property));
+            if (!value.isValid()) {
+                return QByteArray();
+            }
+            values << value;
+        }
+        return Index::encodeKey(values);
+    }
+
+    Akonadi2::Pipeline *mPipeline;
+    DomainTypeAdaptorFactoryInterface::Ptr mFactory;
+    QList<QByteArray> mProperties;
+    QString mName;
+};
+
+//Maintains the interval index of a start and end property, which answers overlap queries
+class IntervalIndexer : public PropertyIndexer
+{
+public:
+    IntervalIndexer(Akonadi2::Pipeline *pipeline, const DomainTypeAdaptorFactoryInterface::Ptr &factory, const QByteArray &startProperty, const QByteArray &endProperty)
+        : PropertyIndexer(pipeline, factory, QList<QByteArray>() << startProperty << endProperty)
+    {
+        mName += ".interval";
+    }
+
+protected:
+    //An entity without end is indexed as a point in time
+    QByteArray indexKey(const Akonadi2::Entity &e) const Q_DECL_OVERRIDE
+    {
+        const auto adaptor = mFactory->createAdaptor(e);
+        const auto start = adaptor->getProperty(QString::fromLatin1(mProperties.at(0))).toDateTime();
+        if (!start.isValid()) {
+            return QByteArray();
+        }
+        const auto end = adaptor->getProperty(QString::fromLatin1(mProperties.at(1))).toDateTime();
+        return Index::intervalKey(start.toMSecsSinceEpoch(), qMax(start, end.isValid() ? end : start).toMSecsSinceEpoch());
+    }
 };
 
+//Maintains the posting lists from the words of the text properties to the keys of the entities containing them
+class FullTextIndexer : public Akonadi2::ConcurrentPreprocessor
+{
+public:
+    FullTextIndexer(Akonadi2::Pipeline *pipeline, const DomainTypeAdaptorFactoryInterface::Ptr &factory, const QList<QByteArray> &properties)
+        : Akonadi2::ConcurrentPreprocessor(),
+        mPipeline(pipeline),
+        mFactory(factory),
+        mProperties(properties)
+    {
+    }
+
+    std::function<void()> processConcurrently(const QByteArray &key, const Akonadi2::Entity &e) Q_DECL_OVERRIDE
+    {
+        return updateIndex(key, QSet<QString>(), tokens(e));
+    }
 
+    std::function<void()> processModificationConcurrently(const QByteArray &key, const Akonadi2::Entity &oldEntity, const Akonadi2::Entity &newEntity) Q_DECL_OVERRIDE
+    {
+        //Only the postings of words that were added or removed are touched
+        const auto oldTokens = tokens(oldEntity);
+        const auto newTokens = tokens(newEntity);
+        return updateIndex(key, QSet<QString>(oldTokens).subtract(newTokens), QSet<QString>(newTokens).subtract(oldTokens));
+    }
+
+    std::function<void()> processRemovalConcurrently(const QByteArray &key, const Akonadi2::Entity &e) Q_DECL_OVERRIDE
+    {
+        return updateIndex(key, tokens(e), QSet<QString>());
+    }
+
+    QString id() const
+    {
+        return "fulltextIndexer";
+    }
+
+    QStringList writtenIndexes() const Q_DECL_OVERRIDE
+    {
+        return QStringList() << "fulltext";
+    }
+
+    QList<QByteArray> readProperties() const Q_DECL_OVERRIDE
+    {
+        return mProperties;
+    }
+
+private:
+    QSet<QString> tokens(const Akonadi2::Entity &e) const
+    {
+        const auto adaptor = mFactory->createAdaptor(e);
+        QSet<QString> result;
+        for (const auto &property : mProperties) {
+            result += Index::tokenize(adaptor->getProperty(QString::fromLatin1(property)).toString()).toSet();
+        }
+        return result;
+    }
+
+    std::function<void()> updateIndex(const QByteArray &key, const QSet<QString> &removed, const QSet<QString> &added) const
+    {
+        if (removed.isEmpty() && added.isEmpty()) {
+            return std::function<void()>();
+        }
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        return [pipeline, key, removed, added]() {
+            auto &index = pipeline->index("fulltext");
+            for (const auto &token : removed) {
+                index.remove(token.toUtf8(), key);
+            }
+            for (const auto &token : added) {
+                index.add(token.toUtf8(), key);
+            }
+        };
+    }
+
+    Akonadi2::Pipeline *mPipeline;
+    DomainTypeAdaptorFactoryInterface::Ptr mFactory;
+    QList<QByteArray> mProperties;
+};
 
 static std::string createEvent()
 {
@@ -110,7 +291,8 @@ public:
         : QObject(),
         mPipeline(pipeline),
         mCommandQueues(commandQueues),
-        mProcessingLock(false)
+        mProcessingLock(false),
+        mBatchSize(100)
     {
         for (auto queue : mCommandQueues) {
             const bool ret = connect(queue, &MessageQueue::messageReady, this, &Processor::process);
@@ -144,57 +326,119 @@ private slots:
         }).exec();
     }
 
+    //Runs next once job succeeded
+    static Async::Job<void> chain(Async::Job<void> job, Async::Job<void> next)
+    {
+        return job.then<void>([next](Async::Future<void> &future) {
+            //The error of a previous job has already been propagated to this future
+            if (future.errorCode()) {
+                return;
+            }
+            Async::Job<void> nextJob = next;
+            nextJob.then<void>([&future](Async::Future<void> &f) {
+                future.setFinished();
+                f.setFinished();
+            },
+            [&future](int errorCode, const QString &errorMessage) {
+                future.setError(errorCode, errorMessage);
+            }).exec();
+        });
+    }
+
+    //Only create commands share a batch. A failed batch is retried message by message,
+    //so a batch must not contain commands whose changes are committed before a later command fails.
+    static bool isCreateCommand(const QByteArray &message)
+    {
+        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(message.constData()), message.size());
+        return Akonadi2::VerifyQueuedCommandBuffer(verifyer) && Akonadi2::GetQueuedCommand(message.constData())->commandId() == Akonadi2::Commands::CreateEntityCommand;
+    }
+
+    Async::Job<void> processQueuedCommands(const QVector<QByteArray> &messages)
+    {
+        //The queue only batches create commands (see isCreateCommand), other commands arrive on their own
+        Async::Job<void> job = Async::null<void>();
+        QVector<QByteArray> createCommands;
+        for (const auto &message : messages) {
+            flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(message.constData()), message.size());
+            if (!Akonadi2::VerifyQueuedCommandBuffer(verifyer)) {
+                qWarning() << "invalid buffer";
+                return Async::error<void>(1, "Invalid queued command");
+            }
+            auto queuedCommand = Akonadi2::GetQueuedCommand(message.constData());
+            qDebug() << "Dequeued: " << queuedCommand->commandId();
+            //Throw command into appropriate pipeline
+            switch (queuedCommand->commandId()) {
+                case Akonadi2::Commands::DeleteEntityCommand:
+                    if (!createCommands.isEmpty()) {
+                        job = chain(job, mPipeline->newEntities(createCommands));
+                        createCommands.clear();
+                    }
+                    job = chain(job, mPipeline->deletedEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()));
+                    break;
+                case Akonadi2::Commands::ModifyEntityCommand:
+                    if (!createCommands.isEmpty()) {
+                        job = chain(job, mPipeline->newEntities(createCommands));
+                        createCommands.clear();
+                    }
+                    job = chain(job, mPipeline->modifiedEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()));
+                    break;
+                case Akonadi2::Commands::CreateEntityCommand:
+                    //The messages are kept alive by the job below
+                    createCommands << QByteArray::fromRawData(reinterpret_cast<char const *>(queuedCommand->command()->Data()), queuedCommand->command()->size());
+                    break;
+                default:
+                    //Unhandled command
+                    qWarning() << "Unhandled command";
+                    break;
+            }
+        }
+        //TODO JOBAPI: job lifetime management
+        //Right now we're just leaking jobs. In this case we'd like jobs that are heap allocated and delete
+        //themselves once done. In other cases we'd like jobs that only live as long as their handle though.
+        if (!createCommands.isEmpty()) {
+            job = chain(job, mPipeline->newEntities(createCommands));
+        }
+        return job.then<void>([messages](Async::Future<void> &future) {
+            if (!future.errorCode()) {
+                future.setFinished();
+            }
+        });
+    }
+
     //Process all messages of this queue
     Async::Job<void> processQueue(MessageQueue *queue)
     {
         auto job = Async::start<void>([this, queue](Async::Future<void> &future) {
             asyncWhile([&, queue](std::function<void(bool)> whileCallback) {
-                queue->dequeue([this, whileCallback](void *ptr, int size, std::function<void(bool success)> messageQueueCallback) {
-                    flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(ptr), size);
-                    if (!Akonadi2::VerifyQueuedCommandBuffer(verifyer)) {
-                        qWarning() << "invalid buffer";
+                //Bounds the memory used by in-flight pipelines, the messages remain in the queue meanwhile
+                const int capacity = mPipeline->availableCapacity();
+                if (capacity <= 0) {
+                    auto connection = QSharedPointer<QMetaObject::Connection>::create();
+                    *connection = QObject::connect(mPipeline, &Akonadi2::Pipeline::capacityAvailable, [whileCallback, connection]() {
+                        QObject::disconnect(*connection);
+                        whileCallback(false);
+                    });
+                    return;
+                }
+                //Create commands are processed in batches so they end up in a single transaction
+                queue->dequeueBatch(qMin(mBatchSize, capacity), [this, whileCallback](const QVector<QByteArray> &messages, std::function<void(bool success)> messageQueueCallback) {
+                    processQueuedCommands(messages).then<void>([messageQueueCallback, whileCallback](Async::Future<void> &future) {
+                        messageQueueCallback(true);
+                        whileCallback(false);
+                        future.setFinished();
+                    },
+                    [this, messageQueueCallback, whileCallback](int errorCode, const QString &errorMessage) {
+                        qWarning() << "Error while processing queue: " << errorCode << errorMessage;
+                        emit error(errorCode, errorMessage);
+                        //The queue retries the messages individually, and eventually moves the failing one to the dead letter queue
                         messageQueueCallback(false);
-                        whileCallback(true);
-                        return;
-                    }
-                    auto queuedCommand = Akonadi2::GetQueuedCommand(ptr);
-                    qDebug() << "Dequeued: " << queuedCommand->commandId();
-                    //Throw command into appropriate pipeline
-                    switch (queuedCommand->commandId()) {
-                        case Akonadi2::Commands::DeleteEntityCommand:
-                            //mPipeline->removedEntity
-                            break;
-                        case Akonadi2::Commands::ModifyEntityCommand:
-                            //mPipeline->modifiedEntity
-                            break;
-                        case Akonadi2::Commands::CreateEntityCommand: {
-                            //TODO JOBAPI: job lifetime management
-                            //Right now we're just leaking jobs. In this case we'd like jobs that are heap allocated and delete
-                            //themselves once done. In other cases we'd like jobs that only live as long as their handle though.
-                            mPipeline->newEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()).then<void>([messageQueueCallback, whileCallback](Async::Future<void> &future) {
-                                messageQueueCallback(true);
-                                whileCallback(false);
-                                future.setFinished();
-                            },
-                            [this, messageQueueCallback, whileCallback](int errorCode, const QString &errorMessage) {
-                                qWarning() << "Error while creating entity: " << errorCode << errorMessage;
-                                emit error(errorCode, errorMessage);
-                                messageQueueCallback(true);
-                                whileCallback(false);
-                            }).exec();
-                        }
-                            break;
-                        default:
-                            //Unhandled command
-                            qWarning() << "Unhandled command";
-                            messageQueueCallback(true);
-                            whileCallback(false);
-                            break;
-                    }
+                        whileCallback(false);
+                    }).exec();
                 },
                 [whileCallback](const MessageQueue::Error &error) {
                     whileCallback(true);
-                });
+                },
+                &Processor::isCreateCommand);
             },
             [&future]() { //while complete
                 future.setFinished();
@@ -233,14 +477,71 @@ private:
     //Ordered by priority
     QList<MessageQueue*> mCommandQueues;
     bool mProcessingLock;
+    //Maximum number of messages that are processed within one pipeline transaction
+    int mBatchSize;
 };
 
+//The limits can be tuned through the environment, i.e. for bulk imports
+static int configuredLimit(const char *name, int defaultValue)
+{
+    bool ok = false;
+    const int value = qgetenv(name).toInt(&ok);
+    return ok && value >= 0 ? value : defaultValue;
+}
+
 DummyResource::DummyResource()
     : Akonadi2::Resource(),
     mUserQueue(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.userqueue"),
     mSynchronizerQueue(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.synchronizerqueue"),
+    mClientQueue(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.clientqueue"),
+    mDeadLetterQueue(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.deadletterqueue"),
+    mProcessor(0),
+    mPipeline(0),
+    mThrottled(false),
     mError(0)
 {
+    mUserQueue.setDeadLetterQueue(&mDeadLetterQueue);
+    mClientQueue.setDeadLetterQueue(&mDeadLetterQueue);
+    mSynchronizerQueue.setDeadLetterQueue(&mDeadLetterQueue);
+    //Stop accepting client commands until the pipeline caught up.
+    //Clients that enqueue directly still notify us about every command, so they are throttled as well.
+    const int lowWatermark = configuredLimit("AKONADI2_QUEUE_LOW_WATERMARK", 1000);
+    const int highWatermark = qMax(configuredLimit("AKONADI2_QUEUE_HIGH_WATERMARK", 5000), lowWatermark);
+    for (auto queue : QList<MessageQueue*>() << &mUserQueue << &mClientQueue) {
+        queue->setWatermarks(lowWatermark, highWatermark);
+        QObject::connect(queue, &MessageQueue::highWatermarkReached, [this]() {
+            updateThrottling();
+        });
+        QObject::connect(queue, &MessageQueue::lowWatermarkReached, [this]() {
+            updateThrottling();
+        });
+    }
+    //The queues may still be full from a previous run
+    updateThrottling();
+}
+
+void DummyResource::updateThrottling()
+{
+    //Clients are only released once both queues drained
+    const bool throttled = mUserQueue.isAboveHighWatermark() || mClientQueue.isAboveHighWatermark();
+    if (throttled == mThrottled) {
+        return;
+    }
+    mThrottled = throttled;
+    if (throttled) {
+        qDebug() << "Command queues are full, throttling clients";
+    }
+    if (mThrottleHandler) {
+        mThrottleHandler(throttled);
+    }
+}
+
+void DummyResource::setThrottleHandler(const std::function<void(bool throttled)> &handler)
+{
+    mThrottleHandler = handler;
+    if (mThrottleHandler && mThrottled) {
+        mThrottleHandler(true);
+    }
 }
 
 void DummyResource::configurePipeline(Akonadi2::Pipeline *pipeline)
@@ -249,37 +550,32 @@ void DummyResource::configurePipeline(Akonadi2::Pipeline *pipeline)
     //FIXME we should setup for each resource entity type, not for each domain type
     //i.e. If a resource stores tags as part of each message it needs to update the tag index
     //TODO setup preprocessors for each domain type and pipeline type allowing full customization
-    //Eventually the order should be self configuring, for now it's hardcoded.
-    auto eventIndexer = new SimpleProcessor("summaryprocessor", [eventFactory](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
-        auto adaptor = eventFactory->createAdaptor(entity);
-        // qDebug() << "Summary preprocessor: " << adaptor->getProperty("summary").toString();
-    });
-
-    auto uidIndexer = new SimpleProcessor("uidIndexer", [eventFactory](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
-        static Index uidIndex(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.index.uid", Akonadi2::Storage::ReadWrite);
+    //The order is derived from the properties each preprocessor reads and writes, independent preprocessors run concurrently.
+    auto fullTextIndexer = new FullTextIndexer(pipeline, eventFactory, DummyEventAdaptorFactory::fullTextProperties());
 
-        auto adaptor = eventFactory->createAdaptor(entity);
-        const auto uid = adaptor->getProperty("uid");
-        if (uid.isValid()) {
-            uidIndex.add(uid.toByteArray(), state.key());
-        }
-
-        //TODO would this be worthwhile for performance reasons?
-        // flatbuffers::Verifier verifyer(entity.local()->Data(), entity.local()->size());
-        // if (!Akonadi2::Domain::Buffer::VerifyEventBuffer(verifyer)) {
-        //     qWarning() << "invalid local buffer";
-        //     return;
-        // }
-        // auto localEvent = Akonadi2::Domain::Buffer::GetEvent(entity.local()->Data());
-        // if (localEvent && localEvent->uid()) {
-        //     qDebug() << "got uid: " << QByteArray::fromRawData(reinterpret_cast<const char *>(localEvent->uid()->Data()), localEvent->uid()->size());
-        //     uidIndex.add(QByteArray::fromRawData(reinterpret_cast<const char *>(localEvent->uid()->Data()), localEvent->uid()->size()), state.key());
-        // }
-    });
+    //The index keys are extracted on a worker thread, only the index writes happen on the pipeline thread
+    QVector<Akonadi2::Preprocessor*> indexers;
+    for (const auto &properties : DummyEventAdaptorFactory::indexes()) {
+        indexers << new PropertyIndexer(pipeline, eventFactory, properties);
+    }
+    for (const auto &interval : DummyEventAdaptorFactory::intervalIndexes()) {
+        indexers << new IntervalIndexer(pipeline, eventFactory, interval.first, interval.second);
+    }
+    for (const auto &name : DummyEventAdaptorFactory::bloomFilterIndexes()) {
+        pipeline->index(name).enableBloomFilter();
+    }
 
     //event is the entitytype and not the domain type
-    pipeline->setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << eventIndexer << uidIndexer);
-    mProcessor = new Processor(pipeline, QList<MessageQueue*>() << &mUserQueue << &mSynchronizerQueue);
+    pipeline->setAdaptorFactory("event", eventFactory);
+    pipeline->setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << fullTextIndexer << indexers);
+    //Only runs the preprocessors whose properties changed
+    pipeline->setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, QVector<Akonadi2::Preprocessor*>() << fullTextIndexer << indexers);
+    //Runs when the tombstone of a deleted entity is garbage collected
+    pipeline->setPreprocessors("event", Akonadi2::Pipeline::DeletedPipeline, QVector<Akonadi2::Preprocessor*>() << fullTextIndexer << indexers);
+    //Stop dequeuing commands while the preprocessors are behind
+    pipeline->setMaxActivePipelines(configuredLimit("AKONADI2_MAX_ACTIVE_PIPELINES", 1000));
+    mPipeline = pipeline;
+    mProcessor = new Processor(pipeline, QList<MessageQueue*>() << &mUserQueue << &mClientQueue << &mSynchronizerQueue);
     QObject::connect(mProcessor, &Processor::error, [this](int errorCode, const QString &msg) { onProcessorError(errorCode, msg); });
 }
 
@@ -289,59 +585,98 @@ void DummyResource::onProcessorError(int errorCode, const QString &errorMessage)
     mError = errorCode;
 }
 
+void DummyResource::inspectDeadLetters(flatbuffers::FlatBufferBuilder &fbb)
+{
+    std::vector<flatbuffers::Offset<Akonadi2::DeadLetter> > letters;
+    mDeadLetterQueue.inspect([&](const QByteArray &key, void *ptr, int size) -> bool {
+        int commandId = -1;
+        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(ptr), size);
+        if (Akonadi2::VerifyQueuedCommandBuffer(verifyer)) {
+            commandId = Akonadi2::GetQueuedCommand(ptr)->commandId();
+        }
+        auto letterKey = fbb.CreateString(key.constData(), key.size());
+        letters.push_back(Akonadi2::CreateDeadLetter(fbb, letterKey, commandId, size));
+        return true;
+    });
+    auto location = Akonadi2::CreateDeadLetters(fbb, fbb.CreateVector(letters));
+    Akonadi2::FinishDeadLettersBuffer(fbb, location);
+}
+
 int DummyResource::error() const
 {
     return mError;
 }
 
-void findByRemoteId(QSharedPointer<Akonadi2::Storage> storage, const QString &rid, std::function<void(void *keyValue, int keySize, void *dataValue, int dataSize)> callback)
+//Completes once the preprocessors of all stored entities have run
+static Async::Job<void> waitForPipeline(Akonadi2::Pipeline *pipeline)
 {
-    //TODO lookup in rid index instead of doing a full scan
-    const std::string ridString = rid.toStdString();
-    storage->scan("", [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
-        if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
-            return true;
+    return Async::start<void>([pipeline](Async::Future<void> &f) {
+        if (!pipeline || !pipeline->isProcessing()) {
+            f.setFinished();
+            return;
         }
+        auto connection = QSharedPointer<QMetaObject::Connection>::create();
+        *connection = QObject::connect(pipeline, &Akonadi2::Pipeline::pipelinesDrained, [&f, connection]() {
+            qDebug() << "pipeline drained";
+            QObject::disconnect(*connection);
+            f.setFinished();
+        });
+    });
+}
 
-        Akonadi2::EntityBuffer::extractResourceBuffer(dataValue, dataSize, [&](const uint8_t *buffer, size_t size) {
-            flatbuffers::Verifier verifier(buffer, size);
-            if (DummyCalendar::VerifyDummyEventBuffer(verifier)) {
-                DummyCalendar::DummyEvent const *resourceBuffer = DummyCalendar::GetDummyEvent(buffer);
-                if (resourceBuffer && resourceBuffer->remoteId()) {
-                    if (std::string(resourceBuffer->remoteId()->c_str(), resourceBuffer->remoteId()->size()) == ridString) {
-                        callback(keyValue, keySize, dataValue, dataSize);
-                    }
-                }
+//Completes once all queues are empty at the same time
+static Async::Job<void> waitForQueues(const QList<MessageQueue*> &queues)
+{
+    return Async::start<void>([queues](Async::Future<void> &f) {
+        MessageQueue *pending = 0;
+        for (const auto queue : queues) {
+            if (!queue->isEmpty()) {
+                pending = queue;
+                break;
             }
+        }
+        if (!pending) {
+            qDebug() << "queues are empty";
+            f.setFinished();
+            return;
+        }
+        //Processing one queue may have filled another one, so all of them are checked again
+        auto connection = QSharedPointer<QMetaObject::Connection>::create();
+        *connection = QObject::connect(pending, &MessageQueue::drained, [&f, connection, queues]() {
+            QObject::disconnect(*connection);
+            waitForQueues(queues).then<void>([&f](Async::Future<void> &future) {
+                f.setFinished();
+                future.setFinished();
+            }).exec();
         });
-        return true;
+    });
+}
+
+//The remote id index is maintained by the pipeline, so entities are only found once they have been processed (see waitForPipeline)
+static void findByRemoteId(Akonadi2::Pipeline *pipeline, const QString &rid, const std::function<void(const QByteArray &key)> &callback)
+{
+    pipeline->index("remoteId").lookup(Index::encodeValue(rid), callback, [](const Index::Error &error) {
+        qWarning() << "Error in remote id index: " << QString::fromStdString(error.message);
     });
 }
 
 void DummyResource::enqueueCommand(MessageQueue &mq, int commandId, const QByteArray &data)
 {
     m_fbb.Clear();
-    auto commandData = m_fbb.CreateVector(reinterpret_cast<uint8_t const *>(data.data()), data.size());
-    auto builder = Akonadi2::QueuedCommandBuilder(m_fbb);
-    builder.add_commandId(commandId);
-    builder.add_command(commandData);
-    auto buffer = builder.Finish();
-    Akonadi2::FinishQueuedCommandBuffer(m_fbb, buffer);
+    Akonadi2::Commands::createQueuedCommand(m_fbb, commandId, data.data(), data.size());
     mq.enqueue(m_fbb.GetBufferPointer(), m_fbb.GetSize());
 }
 
 Async::Job<void> DummyResource::synchronizeWithSource(Akonadi2::Pipeline *pipeline)
 {
-    return Async::start<void>([this, pipeline](Async::Future<void> &f) {
+    //Entities that are stored but not indexed yet would otherwise be created again
+    return waitForPipeline(pipeline).then<void>([this, pipeline](Async::Future<void> &f) {
         //TODO use a read-only transaction during the complete sync to sync against a defined revision
-        auto storage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
         for (auto it = s_dataSource.constBegin(); it != s_dataSource.constEnd(); it++) {
             bool isNew = true;
-            if (storage->exists()) {
-                findByRemoteId(storage, it.key(), [&](void *keyValue, int keySize, void *dataValue, int dataSize) {
-                    isNew = false;
-                });
-            }
+            findByRemoteId(pipeline, it.key(), [&isNew](const QByteArray &) {
+                isNew = false;
+            });
             if (isNew) {
                 m_fbb.Clear();
 
@@ -384,19 +719,14 @@ Async::Job<void> DummyResource::synchronizeWithSource(Akonadi2::Pipeline *pipeli
 
 Async::Job<void> DummyResource::processAllMessages()
 {
-    return Async::start<void>([this](Async::Future<void> &f) {
-        //We have to wait for all items to be processed to ensure the synced items are available when a query gets executed.
-        //TODO: report errors while processing sync?
-        //TODO: also check user-queue?
-        if (mSynchronizerQueue.isEmpty()) {
-            qDebug() << "synchronizer queue is empty";
+    //We have to wait for all items to be processed to ensure the synced and the written items are available when a query gets executed.
+    //TODO: report errors while processing sync?
+    return waitForQueues(QList<MessageQueue*>() << &mSynchronizerQueue << &mUserQueue << &mClientQueue).then<void>([this](Async::Future<void> &f) {
+        //The preprocessors may still be running after the entities have been stored
+        waitForPipeline(mPipeline).then<void>([&f](Async::Future<void> &future) {
             f.setFinished();
-        } else {
-            QObject::connect(&mSynchronizerQueue, &MessageQueue::drained, [&f]() {
-                qDebug() << "synchronizer queue drained";
-                f.setFinished();
-            });
-        }
+            future.setFinished();
+        }).exec();
     });
 }
 
@@ -405,6 +735,16 @@ void DummyResource::processCommand(int commandId, const QByteArray &data, uint s
     //TODO instead of copying the command including the full entity first into the command queue, we could directly
     //create a new revision, only pushing a handle into the commandqueue with the relevant changeset (for changereplay).
     //The problem is that we then require write access from multiple threads (or even processes to avoid sending the full entity over the wire).
+    //Clients that have access to our storage can already avoid sending the entity over the wire by writing to the client queue directly.
+    if (commandId == Akonadi2::Commands::ClientQueueUpdateCommand) {
+        flatbuffers::Verifier verifier(reinterpret_cast<const uint8_t *>(data.constData()), size);
+        if (Akonadi2::VerifyClientQueueUpdateBuffer(verifier)) {
+            mClientQueue.notifyEnqueued(Akonadi2::GetClientQueueUpdate(data.constData())->revision());
+        } else {
+            qWarning() << "invalid client queue update";
+        }
+        return;
+    }
     enqueueCommand(mUserQueue, commandId, data);
 }
 
@@ -38,15 +38,23 @@ public:
     Async::Job<void> processAllMessages();
     void processCommand(int commandId, const QByteArray &data, uint size, Akonadi2::Pipeline *pipeline);
     void configurePipeline(Akonadi2::Pipeline *pipeline);
+    void setThrottleHandler(const std::function<void(bool throttled)> &handler);
+    void inspectDeadLetters(flatbuffers::FlatBufferBuilder &fbb);
     int error() const;
 
 private:
     void onProcessorError(int errorCode, const QString &errorMessage);
+    void updateThrottling();
     void enqueueCommand(MessageQueue &mq, int commandId, const QByteArray &data);
     flatbuffers::FlatBufferBuilder m_fbb;
     MessageQueue mUserQueue;
+    MessageQueue mClientQueue;
     MessageQueue mSynchronizerQueue;
+    MessageQueue mDeadLetterQueue;
     Processor *mProcessor;
+    Akonadi2::Pipeline *mPipeline;
+    std::function<void(bool throttled)> mThrottleHandler;
+    bool mThrottled;
     int mError;
 };
 
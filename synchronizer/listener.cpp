@@ -26,6 +26,7 @@
 
 // commands
 #include "common/commandcompletion_generated.h"
+#include "common/deadletters_generated.h"
 #include "common/handshake_generated.h"
 #include "common/revisionupdate_generated.h"
 #include "common/synchronize_generated.h"
@@ -33,6 +34,20 @@
 #include <QLocalSocket>
 #include <QTimer>
 
+//Revision updates within this window are coalesced into one
+static const int s_revisionUpdateWindow = 50;
+//While throttled we stop reading from clients that have this many entity commands held back, which blocks them
+static const int s_maxHeldCommandsSize = 1024 * 1024;
+//The read buffer of the sockets is limited while throttled, so the data of a blocked client remains in the socket
+static const int s_throttledReadBufferSize = 1024 * 1024;
+
+static bool isEntityCommand(int commandId)
+{
+    return commandId == Akonadi2::Commands::CreateEntityCommand ||
+           commandId == Akonadi2::Commands::ModifyEntityCommand ||
+           commandId == Akonadi2::Commands::DeleteEntityCommand;
+}
+
 Listener::Listener(const QString &resourceName, QObject *parent)
     : QObject(parent),
       m_server(new QLocalServer(this)),
@@ -40,10 +55,18 @@ Listener::Listener(const QString &resourceName, QObject *parent)
       m_resource(0),
       m_pipeline(new Akonadi2::Pipeline(resourceName, parent)),
       m_clientBufferProcessesTimer(new QTimer(this)),
-      m_messageId(0)
+      m_revisionUpdateTimer(new QTimer(this)),
+      m_messageId(0),
+      m_throttled(false)
 {
     connect(m_pipeline, &Akonadi2::Pipeline::revisionUpdated,
             this, &Listener::refreshRevision);
+    //The final revision of a batch is sent right away
+    connect(m_pipeline, &Akonadi2::Pipeline::pipelinesDrained,
+            this, &Listener::updateClientsWithRevision);
+    m_revisionUpdateTimer->setSingleShot(true);
+    connect(m_revisionUpdateTimer, &QTimer::timeout,
+            this, &Listener::updateClientsWithRevision);
     connect(m_server, &QLocalServer::newConnection,
              this, &Listener::acceptConnection);
     log(QString("Trying to open %1").arg(resourceName));
@@ -106,6 +129,9 @@ void Listener::acceptConnection()
     }
 
     log("Got a connection");
+    if (m_throttled) {
+        socket->setReadBufferSize(s_throttledReadBufferSize);
+    }
     Client client("Unknown Client", socket);
     connect(socket, &QIODevice::readyRead,
             this, &Listener::readFromSocket);
@@ -152,6 +178,10 @@ void Listener::readFromSocket()
     log("Reading from socket...");
     for (Client &client: m_connections) {
         if (client.socket == socket) {
+            if (m_throttled && client.heldCommands.size() >= s_maxHeldCommandsSize) {
+                //The data remains in the socket until the resource caught up
+                break;
+            }
             client.commandBuffer += socket->readAll();
             if (processClientBuffer(client) && !m_clientBufferProcessesTimer->isActive()) {
                 // we have more client buffers to handle
@@ -191,6 +221,7 @@ void Listener::processCommand(int commandId, uint messageId, Client &client, uin
             if (Akonadi2::VerifyHandshakeBuffer(verifier)) {
                 auto buffer = Akonadi2::GetHandshake(client.commandBuffer.constData());
                 client.name = buffer->name()->c_str();
+                client.revisionUpdateInterval = buffer->revisionUpdateInterval();
                 sendCurrentRevision(client);
             } else {
                 qWarning() << "received invalid command";
@@ -237,12 +268,20 @@ void Listener::processCommand(int commandId, uint messageId, Client &client, uin
         case Akonadi2::Commands::DeleteEntityCommand:
         case Akonadi2::Commands::ModifyEntityCommand:
         case Akonadi2::Commands::CreateEntityCommand:
+        case Akonadi2::Commands::ClientQueueUpdateCommand:
             log(QString("\tCommand id %1 of type %2 from %3").arg(messageId).arg(commandId).arg(client.name));
             loadResource();
             if (m_resource) {
                 m_resource->processCommand(commandId, client.commandBuffer, size, m_pipeline);
             }
             break;
+        case Akonadi2::Commands::DeadLettersCommand:
+            log(QString("\tDead letter inspection request (id %1) from %2").arg(messageId).arg(client.name));
+            loadResource();
+            if (m_resource) {
+                sendDeadLetters(client);
+            }
+            break;
         case Akonadi2::Commands::ShutdownCommand:
             log(QString("\tReceived shutdown command from %1").arg(client.name));
             callback();
@@ -277,6 +316,12 @@ bool Listener::processClientBuffer(Client &client)
     //TODO: reject messages above a certain size?
 
     if (size <= uint(client.commandBuffer.size() - headerSize)) {
+        if (isEntityCommand(commandId) && (m_throttled || !client.heldCommands.isEmpty())) {
+            //Only the commands that fill the queues are held back, the client can still handshake, synchronize or shut us down.
+            client.heldCommands += client.commandBuffer.left(headerSize + size);
+            client.commandBuffer.remove(0, headerSize + size);
+            return client.commandBuffer.size() >= headerSize;
+        }
         client.commandBuffer.remove(0, headerSize);
 
         processCommand(commandId, messageId, client, size, [this, messageId, commandId, &client]() {
@@ -293,15 +338,33 @@ bool Listener::processClientBuffer(Client &client)
 }
 
 void Listener::sendCurrentRevision(Client &client)
+{
+    sendRevision(client, m_pipeline->storage().maxRevision());
+}
+
+void Listener::sendRevision(Client &client, qint64 revision)
 {
     if (!client.socket || !client.socket->isValid()) {
         return;
     }
 
-    auto command = Akonadi2::CreateRevisionUpdate(m_fbb, m_pipeline->storage().maxRevision());
+    auto command = Akonadi2::CreateRevisionUpdate(m_fbb, revision);
     Akonadi2::FinishRevisionUpdateBuffer(m_fbb, command);
     Akonadi2::Commands::write(client.socket, ++m_messageId, Akonadi2::Commands::RevisionUpdateCommand, m_fbb);
     m_fbb.Clear();
+    client.revision = revision;
+    client.lastRevisionUpdate.start();
+}
+
+void Listener::sendDeadLetters(Client &client)
+{
+    if (!client.socket || !client.socket->isValid()) {
+        return;
+    }
+
+    m_resource->inspectDeadLetters(m_fbb);
+    Akonadi2::Commands::write(client.socket, ++m_messageId, Akonadi2::Commands::DeadLettersCommand, m_fbb);
+    m_fbb.Clear();
 }
 
 void Listener::sendCommandCompleted(Client &client, uint messageId)
@@ -318,23 +381,65 @@ void Listener::sendCommandCompleted(Client &client, uint messageId)
 
 void Listener::refreshRevision()
 {
-    updateClientsWithRevision();
+    //A pending update for a client with a longer interval must not delay the others
+    if (!m_revisionUpdateTimer->isActive() || m_revisionUpdateTimer->remainingTime() > s_revisionUpdateWindow) {
+        m_revisionUpdateTimer->start(s_revisionUpdateWindow);
+    }
 }
 
 void Listener::updateClientsWithRevision()
 {
     //FIXME don't send revision updates for revisions that are still being processed.
-    auto command = Akonadi2::CreateRevisionUpdate(m_fbb, m_pipeline->storage().maxRevision());
-    Akonadi2::FinishRevisionUpdateBuffer(m_fbb, command);
-
-    for (const Client &client: m_connections) {
-        if (!client.socket || !client.socket->isValid()) {
+    const qint64 revision = m_pipeline->storage().maxRevision();
+    qint64 nextUpdate = -1;
+    for (Client &client: m_connections) {
+        if (!client.socket || !client.socket->isValid() || client.revision >= revision) {
             continue;
         }
+        if (client.revisionUpdateInterval > 0 && client.lastRevisionUpdate.isValid()) {
+            const qint64 remaining = client.revisionUpdateInterval - client.lastRevisionUpdate.elapsed();
+            if (remaining > 0) {
+                //The client gets the latest revision once its interval expired
+                nextUpdate = nextUpdate < 0 ? remaining : qMin(nextUpdate, remaining);
+                continue;
+            }
+        }
+        sendRevision(client, revision);
+    }
+    if (nextUpdate >= 0 && (!m_revisionUpdateTimer->isActive() || m_revisionUpdateTimer->remainingTime() > nextUpdate)) {
+        m_revisionUpdateTimer->start(static_cast<int>(nextUpdate));
+    }
+}
 
-        Akonadi2::Commands::write(client.socket, ++m_messageId, Akonadi2::Commands::RevisionUpdateCommand, m_fbb);
+void Listener::setThrottled(bool throttled)
+{
+    if (m_throttled == throttled) {
+        return;
+    }
+    m_throttled = throttled;
+    if (m_throttled) {
+        log("Throttling clients");
+        for (Client &client: m_connections) {
+            if (client.socket) {
+                client.socket->setReadBufferSize(s_throttledReadBufferSize);
+            }
+        }
+        return;
+    }
+
+    log("Resuming clients");
+    //The held back commands go first, followed by everything that was left in the sockets while throttled
+    for (Client &client: m_connections) {
+        client.commandBuffer.prepend(client.heldCommands);
+        client.heldCommands.clear();
+        if (client.socket && client.socket->isValid()) {
+            client.socket->setReadBufferSize(0);
+            client.commandBuffer += client.socket->readAll();
+        }
+    }
+    if (!m_clientBufferProcessesTimer->isActive()) {
+        m_clientBufferProcessesTimer->start();
     }
-    m_fbb.Clear();
 }
 
 void Listener::loadResource()
@@ -351,6 +456,11 @@ void Listener::loadResource()
         //TODO: this doesn't really list all the facades .. fix
         log(QString("\tFacades: %1").arg(Akonadi2::FacadeFactory::instance().getFacade<Akonadi2::Domain::Event>(m_resourceName)->type()));
         m_resource->configurePipeline(m_pipeline);
+        //Finish processing entities that were interrupted by a crash
+        m_pipeline->resumePipelines();
+        m_resource->setThrottleHandler([this](bool throttled) {
+            setThrottled(throttled);
+        });
     } else {
         log(QString("Failed to load resource %1").arg(m_resourceName));
     }
@@ -22,6 +22,7 @@
 #include <QLocalServer>
 #include <QLocalSocket>
 #include <QObject>
+#include <QElapsedTimer>
 
 #include <flatbuffers/flatbuffers.h>
 
@@ -38,19 +39,30 @@ class Client
 {
 public:
     Client()
-        : socket(nullptr)
+        : socket(nullptr),
+          revision(-1),
+          revisionUpdateInterval(0)
     {
     }
 
     Client(const QString &n, QLocalSocket *s)
         : name(n),
-          socket(s)
+          socket(s),
+          revision(-1),
+          revisionUpdateInterval(0)
     {
     }
 
     QString name;
     QLocalSocket *socket;
     QByteArray commandBuffer;
+    //The entity commands that are held back while the resource is throttled, in the order they were received
+    QByteArray heldCommands;
+    //The last revision that was sent to the client
+    qint64 revision;
+    //The minimum interval between two revision updates requested by the client
+    int revisionUpdateInterval;
+    QElapsedTimer lastRevisionUpdate;
 };
 
 class Listener : public QObject
@@ -74,14 +86,17 @@ private Q_SLOTS:
     void readFromSocket();
     void processClientBuffers();
     void refreshRevision();
+    void updateClientsWithRevision();
 
 private:
     void processCommand(int commandId, uint messageId, Client &client, uint size, const std::function<void()> &callback);
     bool processClientBuffer(Client &client);
     void sendCurrentRevision(Client &client);
+    void sendRevision(Client &client, qint64 revision);
     void sendCommandCompleted(Client &client, uint messageId);
-    void updateClientsWithRevision();
+    void sendDeadLetters(Client &client);
     void loadResource();
+    void setThrottled(bool throttled);
     void log(const QString &);
 
     QLocalServer *m_server;
@@ -92,5 +107,7 @@ private:
     Akonadi2::Pipeline *m_pipeline;
     QTimer *m_clientBufferProcessesTimer;
     QTimer *m_checkConnectionsTimer;
+    QTimer *m_revisionUpdateTimer;
     int m_messageId;
+    bool m_throttled;
 };
@@ -146,6 +146,20 @@ private Q_SLOTS:
             auto adaptor = factory.createAdaptor(buffer.entity());
             QCOMPARE(adaptor->getProperty("summary").toString(), QString("summary1"));
         }
+
+        //Assemble the same entity without a builder
+        {
+            QByteArray data(Akonadi2::EntityBuffer::entityBufferSize(metadataFbb.GetSize(), m_fbb.GetSize(), m_fbb.GetSize()), 0);
+            Akonadi2::EntityBuffer::assembleEntityBuffer(data.data(), metadataFbb.GetBufferPointer(), metadataFbb.GetSize(), m_fbb.GetBufferPointer(), m_fbb.GetSize(), m_fbb.GetBufferPointer(), m_fbb.GetSize());
+            flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+            QVERIFY(Akonadi2::VerifyEntityBuffer(verifyer));
+            Akonadi2::EntityBuffer buffer(data.data(), data.size());
+            QCOMPARE(Akonadi2::GetMetadata(buffer.metadataBuffer())->revision(), static_cast<uint64_t>(1));
+
+            TestFactory factory;
+            auto adaptor = factory.createAdaptor(buffer.entity());
+            QCOMPARE(adaptor->getProperty("summary").toString(), QString("summary1"));
+        }
     }
 
 };
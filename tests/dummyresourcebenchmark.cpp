@@ -25,6 +25,16 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.index.summary.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime.endTime.interval");
+        removeFromDisk("org.kde.dummy.index.fulltext");
+        removeFromDisk("org.kde.dummy.index.remoteId");
+        removeFromDisk("org.kde.dummy.index.uid.bloom");
+        removeFromDisk("org.kde.dummy.index.remoteId.bloom");
+        removeFromDisk("org.kde.dummy.progress");
+        removeFromDisk("org.kde.dummy.oldentities");
+        removeFromDisk("org.kde.dummy.tombstones");
     }
 
     void cleanup()
@@ -33,6 +43,16 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.index.summary.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime.endTime.interval");
+        removeFromDisk("org.kde.dummy.index.fulltext");
+        removeFromDisk("org.kde.dummy.index.remoteId");
+        removeFromDisk("org.kde.dummy.index.uid.bloom");
+        removeFromDisk("org.kde.dummy.index.remoteId.bloom");
+        removeFromDisk("org.kde.dummy.progress");
+        removeFromDisk("org.kde.dummy.oldentities");
+        removeFromDisk("org.kde.dummy.tombstones");
     }
 
     void testWriteToFacadeAndQueryByUid()
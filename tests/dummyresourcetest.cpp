@@ -7,10 +7,14 @@
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deadletters_generated.h"
 #include "dummyresource/resourcefactory.h"
 #include "clientapi.h"
 #include "commands.h"
 #include "entitybuffer.h"
+#include "index.h"
+#include "resourceaccess.h"
 
 static void removeFromDisk(const QString &name)
 {
@@ -18,6 +22,76 @@ static void removeFromDisk(const QString &name)
     store.removeFromDisk();
 }
 
+static QByteArray createEventBuffer(const QString &uid)
+{
+    flatbuffers::FlatBufferBuilder eventFbb;
+    eventFbb.Clear();
+    {
+        auto summary = eventFbb.CreateString("summary");
+        Akonadi2::Domain::Buffer::EventBuilder eventBuilder(eventFbb);
+        eventBuilder.add_summary(summary);
+        auto eventLocation = eventBuilder.Finish();
+        Akonadi2::Domain::Buffer::FinishEventBuffer(eventFbb, eventLocation);
+    }
+
+    flatbuffers::FlatBufferBuilder localFbb;
+    {
+        auto uidString = localFbb.CreateString(uid.toStdString());
+        auto localBuilder = Akonadi2::Domain::Buffer::EventBuilder(localFbb);
+        localBuilder.add_uid(uidString);
+        auto location = localBuilder.Finish();
+        Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, location);
+    }
+
+    flatbuffers::FlatBufferBuilder entityFbb;
+    Akonadi2::EntityBuffer::assembleEntityBuffer(entityFbb, 0, 0, eventFbb.GetBufferPointer(), eventFbb.GetSize(), localFbb.GetBufferPointer(), localFbb.GetSize());
+    return QByteArray(reinterpret_cast<const char *>(entityFbb.GetBufferPointer()), entityFbb.GetSize());
+}
+
+static void createEventCommand(flatbuffers::FlatBufferBuilder &fbb, const QString &uid)
+{
+    const QByteArray entity = createEventBuffer(uid);
+    auto type = fbb.CreateString(Akonadi2::Domain::getTypeName<Akonadi2::Domain::Event>().toStdString().data());
+    auto delta = fbb.CreateVector<uint8_t>(reinterpret_cast<const uint8_t *>(entity.constData()), entity.size());
+    Akonadi2::Commands::CreateEntityBuilder builder(fbb);
+    builder.add_domainType(type);
+    builder.add_delta(delta);
+    auto location = builder.Finish();
+    Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
+}
+
+static QByteArray createEventCommand(const QString &uid)
+{
+    flatbuffers::FlatBufferBuilder fbb;
+    createEventCommand(fbb, uid);
+    return QByteArray(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
+static QByteArray modifyEventCommand(const QByteArray &key, const QString &uid)
+{
+    const QByteArray entity = createEventBuffer(uid);
+    flatbuffers::FlatBufferBuilder fbb;
+    auto type = fbb.CreateString(Akonadi2::Domain::getTypeName<Akonadi2::Domain::Event>().toStdString().data());
+    auto entityId = fbb.CreateString(Akonadi2::Storage::printableKey(key).toStdString());
+    auto delta = fbb.CreateVector<uint8_t>(reinterpret_cast<const uint8_t *>(entity.constData()), entity.size());
+    Akonadi2::ModifyEntityBuilder builder(fbb);
+    builder.add_entityId(entityId);
+    builder.add_domainType(type);
+    builder.add_delta(delta);
+    Akonadi2::FinishModifyEntityBuffer(fbb, builder.Finish());
+    return QByteArray(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
+static QList<QByteArray> lookupKeys(Akonadi2::Pipeline &pipeline, const QString &index, const QString &value)
+{
+    QList<QByteArray> keys;
+    pipeline.index(index).lookup(Index::encodeValue(value), [&keys](const QByteArray &key) {
+        keys << key;
+    },
+    [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+    return keys;
+}
+
 class DummyResourceTest : public QObject
 {
     Q_OBJECT
@@ -28,8 +102,20 @@ private Q_SLOTS:
         QVERIFY(factory);
         removeFromDisk("org.kde.dummy");
         removeFromDisk("org.kde.dummy.userqueue");
+        removeFromDisk("org.kde.dummy.clientqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
+        removeFromDisk("org.kde.dummy.deadletterqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.index.summary.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime.endTime.interval");
+        removeFromDisk("org.kde.dummy.index.fulltext");
+        removeFromDisk("org.kde.dummy.index.remoteId");
+        removeFromDisk("org.kde.dummy.index.uid.bloom");
+        removeFromDisk("org.kde.dummy.index.remoteId.bloom");
+        removeFromDisk("org.kde.dummy.progress");
+        removeFromDisk("org.kde.dummy.oldentities");
+        removeFromDisk("org.kde.dummy.tombstones");
     }
 
     void cleanup()
@@ -37,46 +123,27 @@ private Q_SLOTS:
         Akonadi2::Store::shutdown("org.kde.dummy");
         removeFromDisk("org.kde.dummy");
         removeFromDisk("org.kde.dummy.userqueue");
+        removeFromDisk("org.kde.dummy.clientqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
+        removeFromDisk("org.kde.dummy.deadletterqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.index.summary.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime");
+        removeFromDisk("org.kde.dummy.index.startTime.endTime.interval");
+        removeFromDisk("org.kde.dummy.index.fulltext");
+        removeFromDisk("org.kde.dummy.index.remoteId");
+        removeFromDisk("org.kde.dummy.index.uid.bloom");
+        removeFromDisk("org.kde.dummy.index.remoteId.bloom");
+        removeFromDisk("org.kde.dummy.progress");
+        removeFromDisk("org.kde.dummy.oldentities");
+        removeFromDisk("org.kde.dummy.tombstones");
         auto factory = Akonadi2::ResourceFactory::load("org.kde.dummy");
         QVERIFY(factory);
     }
 
     void testProcessCommand()
     {
-        flatbuffers::FlatBufferBuilder eventFbb;
-        eventFbb.Clear();
-        {
-            auto summary = eventFbb.CreateString("summary");
-            Akonadi2::Domain::Buffer::EventBuilder eventBuilder(eventFbb);
-            eventBuilder.add_summary(summary);
-            auto eventLocation = eventBuilder.Finish();
-            Akonadi2::Domain::Buffer::FinishEventBuffer(eventFbb, eventLocation);
-        }
-
-        flatbuffers::FlatBufferBuilder localFbb;
-        {
-            auto uid = localFbb.CreateString("testuid");
-            auto localBuilder = Akonadi2::Domain::Buffer::EventBuilder(localFbb);
-            localBuilder.add_uid(uid);
-            auto location = localBuilder.Finish();
-            Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, location);
-        }
-
-        flatbuffers::FlatBufferBuilder entityFbb;
-        Akonadi2::EntityBuffer::assembleEntityBuffer(entityFbb, 0, 0, eventFbb.GetBufferPointer(), eventFbb.GetSize(), localFbb.GetBufferPointer(), localFbb.GetSize());
-
-        flatbuffers::FlatBufferBuilder fbb;
-        auto type = fbb.CreateString(Akonadi2::Domain::getTypeName<Akonadi2::Domain::Event>().toStdString().data());
-        auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
-        Akonadi2::Commands::CreateEntityBuilder builder(fbb);
-        builder.add_domainType(type);
-        builder.add_delta(delta);
-        auto location = builder.Finish();
-        Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
-
-        const QByteArray command(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+        const QByteArray command = createEventCommand("testuid");
         {
             flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(command.data()), command.size());
             QVERIFY(Akonadi2::Commands::VerifyCreateEntityBuffer(verifyer));
@@ -96,6 +163,147 @@ private Q_SLOTS:
         QCOMPARE(revisionSpy.count(), 2);
     }
 
+    void testFailingCommandAfterCreates()
+    {
+        const QByteArray command = createEventCommand("batchuid");
+        //Not a modify entity buffer, so the modification fails every time
+        const QByteArray modifyCommand("malformed modification");
+        {
+            //Without a pipeline nothing is processed, so all commands are dequeued together later on
+            DummyResource resource;
+            for (int i = 0; i < 3; i++) {
+                resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), 0);
+            }
+            resource.processCommand(Akonadi2::Commands::ModifyEntityCommand, modifyCommand, modifyCommand.size(), 0);
+        }
+
+        Akonadi2::Pipeline pipeline("org.kde.dummy");
+        DummyResource resource;
+        resource.configurePipeline(&pipeline);
+        resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), &pipeline);
+
+        const auto lookup = [&pipeline]() {
+            int count = 0;
+            pipeline.index("uid").lookup(Index::encodeValue(QString("batchuid")), [&count](const QByteArray &) {
+                count++;
+            },
+            [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+            return count;
+        };
+        //The modification is retried until it ends up in the dead letter queue, the creates are not repeated meanwhile
+        const auto deadLetters = [&resource]() {
+            flatbuffers::FlatBufferBuilder fbb;
+            resource.inspectDeadLetters(fbb);
+            return static_cast<int>(Akonadi2::GetDeadLetters(fbb.GetBufferPointer())->letters()->size());
+        };
+        QTRY_VERIFY_WITH_TIMEOUT(deadLetters() > 0, 10000);
+        QCOMPARE(deadLetters(), 1);
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(lookup(), 4);
+        QVERIFY(resource.error());
+    }
+
+    void testPipelineCapacity()
+    {
+        const QByteArray command = createEventCommand("capacityuid");
+        {
+            //Without a pipeline the commands stay in the queue
+            DummyResource resource;
+            for (int i = 0; i < 10; i++) {
+                resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), 0);
+            }
+        }
+
+        qputenv("AKONADI2_MAX_ACTIVE_PIPELINES", "2");
+        Akonadi2::Pipeline pipeline("org.kde.dummy");
+        DummyResource resource;
+        resource.configurePipeline(&pipeline);
+        qunsetenv("AKONADI2_MAX_ACTIVE_PIPELINES");
+        QSignalSpy capacitySpy(&pipeline, SIGNAL(capacityAvailable()));
+
+        //The processor stops dequeuing once the preprocessors of two entities are outstanding
+        resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), &pipeline);
+        QCOMPARE(pipeline.storage().maxRevision(), qint64(2));
+        QCOMPARE(pipeline.availableCapacity(), 0);
+
+        //And continues with the remaining commands whenever capacity becomes available
+        QTRY_COMPARE(lookupKeys(pipeline, "uid", "capacityuid").size(), 11);
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QVERIFY(capacitySpy.count() >= 5);
+    }
+
+    void testResumeModifiedPipeline()
+    {
+        QByteArray key;
+        {
+            Akonadi2::Pipeline pipeline("org.kde.dummy");
+            DummyResource resource;
+            resource.configurePipeline(&pipeline);
+            const QByteArray command = createEventCommand("resumeuid");
+            resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), &pipeline);
+            QTRY_COMPARE(lookupKeys(pipeline, "uid", "resumeuid").size(), 1);
+            QTRY_VERIFY(!pipeline.isProcessing());
+            key = lookupKeys(pipeline, "uid", "resumeuid").first();
+
+            //The pipeline goes away before the preprocessors of the modification are committed, as if the resource crashed
+            const QByteArray modifyCommand = modifyEventCommand(key, "resumeduid");
+            auto future = pipeline.modifiedEntity(modifyCommand.constData(), modifyCommand.size()).exec();
+            QVERIFY(!future.errorCode());
+            QVERIFY(pipeline.isProcessing());
+        }
+
+        Akonadi2::Pipeline pipeline("org.kde.dummy");
+        DummyResource resource;
+        resource.configurePipeline(&pipeline);
+        QCOMPARE(lookupKeys(pipeline, "uid", "resumeuid"), QList<QByteArray>() << key);
+        pipeline.resumePipelines();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        //The entry of the old value is removed as well
+        QCOMPARE(lookupKeys(pipeline, "uid", "resumeuid"), QList<QByteArray>());
+        QCOMPARE(lookupKeys(pipeline, "uid", "resumeduid"), QList<QByteArray>() << key);
+    }
+
+    void testRebuildIndexes()
+    {
+        const QByteArray command = createEventCommand("rebuilduid");
+        Akonadi2::Pipeline pipeline("org.kde.dummy");
+        DummyResource resource;
+        resource.configurePipeline(&pipeline);
+        for (int i = 0; i < 10; i++) {
+            resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), &pipeline);
+        }
+
+        const auto lookup = [&pipeline]() {
+            int count = 0;
+            pipeline.index("uid").lookup(Index::encodeValue(QString("rebuilduid")), [&count](const QByteArray &) {
+                count++;
+            },
+            [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+            return count;
+        };
+        QTRY_COMPARE(lookup(), 10);
+        QTRY_VERIFY(!pipeline.isProcessing());
+
+        //An empty rebuild clears the index
+        pipeline.index("uid").beginRebuild();
+        QVERIFY(pipeline.index("uid").commitRebuild());
+        QCOMPARE(lookup(), 0);
+
+        QVERIFY(pipeline.rebuildIndexes("event", QStringList() << "uidIndexer", 3));
+        QCOMPARE(lookup(), 10);
+
+        //None of the entities has a remote id, so the rebuilt index is empty
+        pipeline.index("remoteId").add(Index::encodeValue(QString("staleRemoteId")), "staleKey");
+        QVERIFY(pipeline.rebuildIndexes("event", QStringList() << "remoteIdIndexer"));
+        int stale = 0;
+        pipeline.index("remoteId").lookupRange(QByteArray(), QByteArray(), [&stale](const QByteArray &, const QByteArray &) -> bool {
+            stale++;
+            return true;
+        },
+        [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+        QCOMPARE(stale, 0);
+    }
+
     void testProperty()
     {
         Akonadi2::Domain::Event event;
@@ -124,6 +332,327 @@ private Q_SLOTS:
         QCOMPARE(value->getProperty("uid").toByteArray(), QByteArray("testuid"));
     }
 
+    void testDirectEnqueue()
+    {
+        //The facade writes to the client queue through ResourceAccess and only notifies the resource
+        qputenv("AKONADI2_DIRECT_ENQUEUE", "1");
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "directuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        qunsetenv("AKONADI2_DIRECT_ENQUEUE");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", "directuid");
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(result.first()->getProperty("summary").toByteArray(), QByteArray("summaryValue"));
+    }
+
+    void testRevisionUpdateInterval()
+    {
+        Akonadi2::ResourceAccess resourceAccess("org.kde.dummy");
+        resourceAccess.setRevisionUpdateInterval(500);
+        QList<qint64> revisions;
+        QList<qint64> times;
+        QElapsedTimer time;
+        time.start();
+        QObject::connect(&resourceAccess, &Akonadi2::ResourceAccess::revisionChanged, [&](unsigned long long revision) {
+            revisions << revision;
+            times << time.elapsed();
+        });
+        resourceAccess.open();
+        //The current revision is sent on connect
+        QTRY_COMPARE(revisions.size(), 1);
+        const qint64 initialRevision = revisions.first();
+
+        const int count = 20;
+        for (int i = 0; i < count; i++) {
+            flatbuffers::FlatBufferBuilder fbb;
+            createEventCommand(fbb, QString("revisionuid%1").arg(i));
+            resourceAccess.sendCommand(Akonadi2::Commands::CreateEntityCommand, fbb).exec().waitForFinished();
+        }
+
+        //The updates are coalesced and respect the interval of the client, but the final revision is always delivered
+        QTRY_COMPARE_WITH_TIMEOUT(revisions.last(), initialRevision + count, 10000);
+        QVERIFY(revisions.size() < count);
+        for (int i = 1; i < revisions.size(); i++) {
+            QVERIFY(revisions.at(i) > revisions.at(i - 1));
+            //Some slack for the transport
+            QVERIFY(times.at(i) - times.at(i - 1) >= 450);
+        }
+    }
+
+    void testWriteToFacadeAndQueryByRange()
+    {
+        const auto start = QDateTime::fromMSecsSinceEpoch(1420070400000);
+        for (int i = 0; i < 4; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", i < 3 ? "rangeSummary" : "otherSummary");
+            event.setProperty("startTime", start.addDays(i));
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.propertyFilter.insert("summary", "rangeSummary");
+        Akonadi2::Query::Range range;
+        range.lower = start.addDays(1);
+        query.rangeFilter.insert("startTime", range);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 2);
+        for (const auto &value : result) {
+            QCOMPARE(value->getProperty("summary").toString(), QString("rangeSummary"));
+            QVERIFY(value->getProperty("startTime").toDateTime() >= start.addDays(1));
+        }
+    }
+
+    void testQuerySortedWithLimit()
+    {
+        const auto start = QDateTime::fromMSecsSinceEpoch(1420070400000);
+        for (int i = 0; i < 5; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", QString("sorted%1").arg(i));
+            event.setProperty("startTime", start.addDays((i * 3) % 5));
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.sortProperty = "startTime";
+        query.sortDescending = true;
+        query.limit = 2;
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 2);
+        QCOMPARE(result.at(0)->getProperty("startTime").toDateTime(), start.addDays(4));
+        QCOMPARE(result.at(1)->getProperty("startTime").toDateTime(), start.addDays(3));
+    }
+
+    void testQuerySortedWithoutSortProperty()
+    {
+        const auto start = QDateTime::fromMSecsSinceEpoch(1420070400000);
+        for (int i = 0; i < 3; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", QString("unsorted%1").arg(i));
+            if (i > 0) {
+                event.setProperty("startTime", start.addDays(i));
+            }
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.sortProperty = "startTime";
+
+        //Sorting doesn't filter, entities without the property come last
+        for (const bool descending : QList<bool>() << false << true) {
+            query.sortDescending = descending;
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 3);
+            QCOMPARE(result.at(0)->getProperty("startTime").toDateTime(), start.addDays(descending ? 2 : 1));
+            QVERIFY(!result.at(2)->getProperty("startTime").isValid());
+        }
+    }
+
+    void testQueryOverlap()
+    {
+        const auto start = QDateTime::fromMSecsSinceEpoch(1420070400000);
+        {
+            //Spans the whole month
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", "long");
+            event.setProperty("startTime", start);
+            event.setProperty("endTime", start.addDays(30));
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+        {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", "inside");
+            event.setProperty("startTime", start.addDays(10));
+            event.setProperty("endTime", start.addDays(10).addSecs(3600));
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+        {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", "outside");
+            event.setProperty("startTime", start.addDays(20));
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.overlapFilter.startProperty = "startTime";
+        query.overlapFilter.endProperty = "endTime";
+        query.overlapFilter.range.lower = start.addDays(9);
+        query.overlapFilter.range.upper = start.addDays(11);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QStringList summaries;
+        for (const auto &value : result) {
+            summaries << value->getProperty("summary").toString();
+        }
+        summaries.sort();
+        QCOMPARE(summaries, QStringList() << "inside" << "long");
+    }
+
+    void testFullTextSearch()
+    {
+        {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", "Team meeting");
+            event.setProperty("description", "Discuss the Quarterly report");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+        {
+            Akonadi2::Domain::Event event;
+            event.setProperty("summary", "Team lunch");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.textSearch = "team quart*";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(result.first()->getProperty("summary").toString(), QString("Team meeting"));
+    }
+
+    void testFullTextPrefixSearch()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("summary", "Team test");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        //Both words start with the prefix, but the entity is only returned once
+        query.textSearch = "te*";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+    }
+
+    void testWriteModifyAndQuery()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "modifyuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", "modifyuid");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            auto value = result.first();
+            value->setProperty("summary", "modifiedSummary");
+            Akonadi2::Store::modify<Akonadi2::Domain::Event>(*value, "org.kde.dummy");
+        }
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            auto value = result.first();
+            QCOMPARE(value->getProperty("summary").toByteArray(), QByteArray("modifiedSummary"));
+            //Unchanged properties are preserved
+            QCOMPARE(value->getProperty("uid").toByteArray(), QByteArray("modifyuid"));
+        }
+    }
+
+    void testWriteDeleteAndQuery()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "deleteuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", "deleteuid");
+        QByteArray key;
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            key = Akonadi2::Storage::entityKey(result.first()->identifier().toUtf8());
+            Akonadi2::Store::remove<Akonadi2::Domain::Event>(*result.first(), "org.kde.dummy");
+        }
+        {
+            //The tombstone hides the entity right away
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 0);
+        }
+
+        //The garbage collection of the resource removes the tombstone and the index entries of the entity
+        const auto entityExists = [&key]() {
+            bool exists = false;
+            Akonadi2::Storage storage(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+            storage.scan(key.toStdString(), [&exists](void *, int, void *, int) -> bool {
+                exists = true;
+                return false;
+            });
+            return exists;
+        };
+        QTRY_VERIFY_WITH_TIMEOUT(!entityExists(), 10000);
+
+        int tombstones = 0;
+        Akonadi2::Storage garbageStorage(Akonadi2::Store::storageLocation(), "org.kde.dummy.tombstones");
+        garbageStorage.scan("", [&tombstones](void *keyPtr, int keySize, void *, int) -> bool {
+            if (!Akonadi2::Storage::isInternalKey(keyPtr, keySize)) {
+                tombstones++;
+            }
+            return true;
+        });
+        QCOMPARE(tombstones, 0);
+
+        QList<QByteArray> indexed;
+        Index uidIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.uid");
+        uidIndex.lookup(Index::encodeValue(QString("deleteuid")), [&indexed](const QByteArray &value) {
+            indexed << value;
+        },
+        [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+        Index fullTextIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.fulltext");
+        for (const auto &token : Index::tokenize("summaryValue")) {
+            fullTextIndex.lookup(token.toUtf8(), [&indexed](const QByteArray &value) {
+                indexed << value;
+            },
+            [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+        }
+        QVERIFY(!indexed.contains(key));
+    }
+
     void testResourceSync()
     {
         Akonadi2::Pipeline pipeline("org.kde.dummy");
@@ -155,6 +684,24 @@ private Q_SLOTS:
         qDebug() << value->getProperty("summary").toString();
     }
 
+    void testSyncTwice()
+    {
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = true;
+        query.processAll = true;
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        const int count = result.size();
+        QVERIFY(count > 0);
+
+        //Items that are already in the store are found by their remote id and not created again
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> secondResult(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        secondResult.exec();
+        QCOMPARE(secondResult.size(), count);
+    }
+
 };
 
 QTEST_MAIN(DummyResourceTest)
@@ -15,12 +15,16 @@ private Q_SLOTS:
     {
         Akonadi2::Storage store(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
         store.removeFromDisk();
+        Akonadi2::Storage bloomStore(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex.bloom", Akonadi2::Storage::ReadWrite);
+        bloomStore.removeFromDisk();
     }
 
     void cleanup()
     {
         Akonadi2::Storage store(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
         store.removeFromDisk();
+        Akonadi2::Storage bloomStore(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex.bloom", Akonadi2::Storage::ReadWrite);
+        bloomStore.removeFromDisk();
     }
 
     void testIndex()
@@ -55,6 +59,141 @@ private Q_SLOTS:
             QCOMPARE(values.size(), 0);
         }
     }
+
+    void testRemoveAndReplace()
+    {
+        Index index(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
+        index.add("key1", "value1");
+        index.add("key1", "value2");
+        index.remove("key1", "value1");
+        index.replace("key1", "key2", "value2");
+
+        {
+            QList<QByteArray> values;
+            index.lookup(QByteArray("key1"), [&values](const QByteArray &value) {
+                values << value;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values.size(), 0);
+        }
+        {
+            QList<QByteArray> values;
+            index.lookup(QByteArray("key2"), [&values](const QByteArray &value) {
+                values << value;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values, QList<QByteArray>() << "value2");
+        }
+    }
+
+    void testEncodingOrder()
+    {
+        QVERIFY(Index::encodeValue(-5) < Index::encodeValue(3));
+        QVERIFY(Index::encodeValue(3) < Index::encodeValue(qint64(1) << 40));
+        QVERIFY(Index::encodeValue(-1.5) < Index::encodeValue(-0.5));
+        QVERIFY(Index::encodeValue(-0.5) < Index::encodeValue(2.25));
+        QVERIFY(Index::encodeValue(QDateTime::fromMSecsSinceEpoch(1000)) < Index::encodeValue(QDateTime::fromMSecsSinceEpoch(2000)));
+        //A string that is a prefix of another one sorts first, also when followed by another component
+        QVERIFY(Index::encodeKey(QVariantList() << "ab" << 9) < Index::encodeKey(QVariantList() << "abc" << 1));
+        QVERIFY(Index::encodeKey(QVariantList() << QByteArray("a\0b", 3) << 1) < Index::encodeKey(QVariantList() << "a\x01" << 1));
+        QCOMPARE(Index::encodeValue("uid1"), QByteArray("uid1"));
+        QCOMPARE(Index::prefixUpperBound("ab"), QByteArray("ac"));
+        QCOMPARE(Index::prefixUpperBound(QByteArray("a\xff", 2)), QByteArray("b"));
+    }
+
+    void testCompositeRange()
+    {
+        Index index(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
+        index.add(Index::encodeKey(QVariantList() << "summary" << 3), "value3");
+        index.add(Index::encodeKey(QVariantList() << "summary" << 1), "value1");
+        index.add(Index::encodeKey(QVariantList() << "summary" << 2), "value2");
+        index.add(Index::encodeKey(QVariantList() << "summary2" << 2), "other");
+
+        const QByteArray prefix = Index::encodeValue("summary", false);
+        {
+            QList<QByteArray> values;
+            index.lookupRange(prefix + Index::encodeValue(2), Index::prefixUpperBound(prefix), [&values](const QByteArray &, const QByteArray &value) -> bool {
+                values << value;
+                return true;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values, QList<QByteArray>() << "value2" << "value3");
+        }
+        {
+            QList<QByteArray> values;
+            index.lookupRange(prefix, Index::prefixUpperBound(prefix), [&values](const QByteArray &, const QByteArray &value) -> bool {
+                values << value;
+                return values.size() < 2;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; }, true);
+            QCOMPARE(values, QList<QByteArray>() << "value3" << "value2");
+        }
+    }
+
+    void testBloomFilter()
+    {
+        //Keys written before the filter was enabled are picked up by the rebuild
+        Index index(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
+        index.add("existing", "value");
+        index.enableBloomFilter(100, 0.01);
+        for (int i = 0; i < 50; i++) {
+            index.add("key" + QByteArray::number(i), "value");
+        }
+        QVERIFY(index.mayContain("existing"));
+        for (int i = 0; i < 50; i++) {
+            QVERIFY(index.mayContain("key" + QByteArray::number(i)));
+        }
+
+        int found = 0;
+        for (int i = 0; i < 1000; i++) {
+            index.lookup("absent" + QByteArray::number(i), [&found](const QByteArray &) {
+                found++;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+        }
+        QCOMPARE(found, 0);
+        const auto statistics = index.bloomFilterStatistics();
+        QCOMPARE(statistics.skipped + statistics.falsePositives, qint64(1000));
+        QVERIFY(statistics.observedFalsePositiveRate() < 0.05);
+        QVERIFY(statistics.estimatedFalsePositiveRate > 0);
+
+        //A reader uses the filter persisted by the writer
+        Index reader(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadOnly);
+        reader.enableBloomFilter();
+        QVERIFY(reader.mayContain("key42"));
+        int skipped = 0;
+        for (int i = 0; i < 100; i++) {
+            skipped += reader.mayContain("absent" + QByteArray::number(i)) ? 0 : 1;
+        }
+        QVERIFY(skipped > 90);
+    }
+
+    void testTokenize()
+    {
+        QCOMPARE(Index::tokenize("Team-Meeting: team notes, v2"), QStringList() << "team" << "meeting" << "notes" << "v2");
+    }
+
+    void testIntervalRanges()
+    {
+        const qint64 hour = 3600000;
+        const auto contains = [](const QVector<QPair<QByteArray, QByteArray> > &ranges, const QByteArray &key) {
+            for (const auto &range : ranges) {
+                if (key >= range.first && key < range.second) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        const auto shortInterval = Index::intervalKey(10 * hour, 11 * hour);
+        const auto longInterval = Index::intervalKey(0, 1000 * hour);
+        const auto negativeInterval = Index::intervalKey(-5 * hour, -hour);
+
+        QVERIFY(contains(Index::intervalRanges(10 * hour + 1, 10 * hour + 2), shortInterval));
+        QVERIFY(contains(Index::intervalRanges(500 * hour, 501 * hour), longInterval));
+        QVERIFY(contains(Index::intervalRanges(-2 * hour, -2 * hour), negativeInterval));
+        //Only intervals in neighbouring buckets are candidates on the lowest level
+        QVERIFY(!contains(Index::intervalRanges(100 * hour, 101 * hour), shortInterval));
+    }
 };
 
 QTEST_MAIN(IndexTest)
@@ -25,6 +25,8 @@ private Q_SLOTS:
     {
         Akonadi2::Storage store(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue", Akonadi2::Storage::ReadWrite);
         store.removeFromDisk();
+        Akonadi2::Storage deadLetterStore(Akonadi2::Store::storageLocation(), "org.kde.dummy.testdeadletterqueue", Akonadi2::Storage::ReadWrite);
+        deadLetterStore.removeFromDisk();
     }
 
     void testEmpty()
@@ -81,6 +83,210 @@ private Q_SLOTS:
         QVERIFY(gotError);
     }
 
+    void testBatch()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        queue.setBackoffInterval(0);
+        QByteArray value("value");
+        for (int i = 0; i < 3; i++) {
+            queue.enqueue(value.data(), value.size());
+        }
+
+        //A failed batch is retried one message at a time
+        int batchSize = 0;
+        queue.dequeueBatch(2, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            batchSize = messages.size();
+            callback(false);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QCOMPARE(batchSize, 2);
+
+        queue.dequeueBatch(2, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            batchSize = messages.size();
+            callback(true);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QCOMPARE(batchSize, 1);
+
+        queue.dequeueBatch(5, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            batchSize = messages.size();
+            callback(true);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QCOMPARE(batchSize, 1);
+
+        queue.dequeueBatch(5, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            batchSize = messages.size();
+            callback(true);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QCOMPARE(batchSize, 1);
+        QVERIFY(queue.isEmpty());
+    }
+
+    void testOrderAcrossDigits()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        for (int i = 1; i <= 12; i++) {
+            const QByteArray value = QByteArray::number(i);
+            queue.enqueue(value.data(), value.size());
+        }
+
+        //Revision 10 must not overtake revision 9
+        QList<QByteArray> dequeued;
+        queue.dequeueBatch(20, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            dequeued = messages.toList();
+            callback(true);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QList<QByteArray> expected;
+        for (int i = 1; i <= 12; i++) {
+            expected << QByteArray::number(i);
+        }
+        QCOMPARE(dequeued, expected);
+    }
+
+    void testBatchable()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        for (const auto &value : QList<QByteArray>() << "batch" << "batch" << "single" << "batch") {
+            queue.enqueue(value.data(), value.size());
+        }
+        const auto isBatchable = [](const QByteArray &message) -> bool {
+            return message == "batch";
+        };
+
+        //A message that isn't batchable ends the batch and is dequeued on its own
+        QList<int> batchSizes;
+        for (int i = 0; i < 3; i++) {
+            queue.dequeueBatch(5, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+                batchSizes << messages.size();
+                callback(true);
+            },
+            [&](const MessageQueue::Error &error) {
+            },
+            isBatchable);
+        }
+        QCOMPARE(batchSizes, QList<int>() << 2 << 1 << 1);
+        QVERIFY(queue.isEmpty());
+    }
+
+    void testDeadLetter()
+    {
+        MessageQueue deadLetterQueue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testdeadletterqueue");
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        queue.setDeadLetterQueue(&deadLetterQueue, 2);
+        queue.setBackoffInterval(0);
+        QByteArray value("value");
+        queue.enqueue(value.data(), value.size());
+
+        for (int i = 0; i < 2; i++) {
+            bool gotValue = false;
+            queue.dequeue([&](void *ptr, int size, std::function<void(bool success)> callback) {
+                gotValue = true;
+                callback(false);
+            },
+            [&](const MessageQueue::Error &error) {
+            });
+            QVERIFY(gotValue);
+        }
+        QVERIFY(queue.isEmpty());
+        QVERIFY(!deadLetterQueue.isEmpty());
+
+        bool gotValue = false;
+        deadLetterQueue.dequeue([&](void *ptr, int size, std::function<void(bool success)> callback) {
+            gotValue = (QByteArray(static_cast<char*>(ptr), size) == value);
+            callback(true);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+        QVERIFY(gotValue);
+    }
+
+    void testBackoff()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        queue.setBackoffInterval(1000);
+        QByteArray value("value");
+        queue.enqueue(value.data(), value.size());
+
+        queue.dequeue([&](void *ptr, int size, std::function<void(bool success)> callback) {
+            callback(false);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+
+        //The failed message is not returned until the backoff interval expired
+        bool gotValue = false;
+        bool gotError = false;
+        queue.dequeue([&](void *ptr, int size, std::function<void(bool success)> callback) {
+            gotValue = true;
+        },
+        [&](const MessageQueue::Error &error) {
+            gotError = true;
+        });
+        QVERIFY(!gotValue);
+        QVERIFY(gotError);
+        QVERIFY(!queue.isEmpty());
+    }
+
+    void testBatchBackoff()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        queue.setBackoffInterval(1000);
+        QByteArray value("value");
+        for (int i = 0; i < 3; i++) {
+            queue.enqueue(value.data(), value.size());
+        }
+
+        queue.dequeueBatch(2, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            callback(false);
+        },
+        [&](const MessageQueue::Error &error) {
+        });
+
+        //A failed batch backs off like a failed message
+        bool gotValue = false;
+        bool gotError = false;
+        queue.dequeueBatch(2, [&](const QVector<QByteArray> &messages, std::function<void(bool success)> callback) {
+            gotValue = true;
+        },
+        [&](const MessageQueue::Error &error) {
+            gotError = true;
+        });
+        QVERIFY(!gotValue);
+        QVERIFY(gotError);
+    }
+
+    void testWatermarks()
+    {
+        MessageQueue queue(Akonadi2::Store::storageLocation(), "org.kde.dummy.testqueue");
+        queue.setWatermarks(1, 3);
+        QSignalSpy highSpy(&queue, SIGNAL(highWatermarkReached()));
+        QSignalSpy lowSpy(&queue, SIGNAL(lowWatermarkReached()));
+        QByteArray value("value");
+        for (int i = 0; i < 3; i++) {
+            queue.enqueue(value.data(), value.size());
+        }
+        QCOMPARE(highSpy.count(), 1);
+        QVERIFY(queue.isAboveHighWatermark());
+
+        for (int i = 0; i < 2; i++) {
+            queue.dequeue([&](void *ptr, int size, std::function<void(bool success)> callback) {
+                callback(true);
+            },
+            [&](const MessageQueue::Error &error) {
+            });
+        }
+        QCOMPARE(lowSpy.count(), 1);
+        QVERIFY(!queue.isAboveHighWatermark());
+    }
+
 };
 
 QTEST_MAIN(MessageQueueTest)
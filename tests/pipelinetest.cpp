@@ -0,0 +1,459 @@
+#include <QtTest>
+
+#include <QString>
+#include <QThread>
+
+#include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "entity_generated.h"
+#include "dummyresource/domainadaptor.h"
+#include "clientapi.h"
+#include "pipeline.h"
+#include "storage.h"
+#include "index.h"
+
+static void removeFromDisk(const QString &name)
+{
+    Akonadi2::Storage store(Akonadi2::Store::storageLocation(), name, Akonadi2::Storage::ReadWrite);
+    store.removeFromDisk();
+}
+
+static QByteArray createEntityCommand(DomainTypeAdaptorFactoryInterface &factory, const QString &uid)
+{
+    auto properties = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create();
+    properties->setProperty("uid", uid);
+    properties->setProperty("summary", "summary");
+    flatbuffers::FlatBufferBuilder entityFbb;
+    factory.createBuffer(Akonadi2::Domain::AkonadiDomainType(QString(), QString(), 0, properties), entityFbb);
+
+    flatbuffers::FlatBufferBuilder fbb;
+    auto type = fbb.CreateString("event");
+    auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
+    auto location = Akonadi2::Commands::CreateCreateEntity(fbb, type, delta);
+    Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
+    return QByteArray(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
+static QByteArray modifyEntityCommand(DomainTypeAdaptorFactoryInterface &factory, const QByteArray &key, const QString &summary)
+{
+    auto changes = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create();
+    changes->setProperty("summary", summary);
+    flatbuffers::FlatBufferBuilder entityFbb;
+    factory.createBuffer(Akonadi2::Domain::AkonadiDomainType(QString(), QString(), 0, changes), entityFbb);
+
+    flatbuffers::FlatBufferBuilder fbb;
+    auto entityId = fbb.CreateString(Akonadi2::Storage::printableKey(key).toStdString());
+    auto type = fbb.CreateString("event");
+    auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
+    auto location = Akonadi2::CreateModifyEntity(fbb, 0, entityId, 0, type, delta);
+    Akonadi2::FinishModifyEntityBuffer(fbb, location);
+    return QByteArray(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
+//Logs its id when it is executed. A deferred preprocessor only completes once complete is called.
+class LoggingPreprocessor : public Akonadi2::Preprocessor
+{
+public:
+    LoggingPreprocessor(const QString &id, const QList<QByteArray> &reads, const QList<QByteArray> &writes, QStringList &log, bool deferred = false)
+        : Akonadi2::Preprocessor(),
+        mId(id),
+        mReads(reads),
+        mWrites(writes),
+        mLog(log),
+        mDeferred(deferred)
+    {
+    }
+
+    void process(const Akonadi2::PipelineState &state, const Akonadi2::Entity &) Q_DECL_OVERRIDE
+    {
+        mLog << mId;
+        lastKey = state.key();
+        if (mDeferred) {
+            mPending << state;
+        } else {
+            processingCompleted(state);
+        }
+    }
+
+    void complete()
+    {
+        for (const auto &state : mPending) {
+            processingCompleted(state);
+        }
+        mPending.clear();
+    }
+
+    QString id() const Q_DECL_OVERRIDE
+    {
+        return mId;
+    }
+
+    QList<QByteArray> readProperties() const Q_DECL_OVERRIDE
+    {
+        return mReads;
+    }
+
+    QList<QByteArray> writtenProperties() const Q_DECL_OVERRIDE
+    {
+        return mWrites;
+    }
+
+    QByteArray lastKey;
+
+private:
+    QString mId;
+    QList<QByteArray> mReads;
+    QList<QByteArray> mWrites;
+    QStringList &mLog;
+    bool mDeferred;
+    QList<Akonadi2::PipelineState> mPending;
+};
+
+//Records the threads the work and the returned commit are executed on
+class ThreadRecordingPreprocessor : public Akonadi2::ConcurrentPreprocessor
+{
+public:
+    std::function<void()> processConcurrently(const QByteArray &key, const Akonadi2::Entity &) Q_DECL_OVERRIDE
+    {
+        {
+            QMutexLocker locker(&mMutex);
+            workThreads << QThread::currentThread();
+        }
+        return [this]() {
+            commitThreads << QThread::currentThread();
+        };
+    }
+
+    QString id() const Q_DECL_OVERRIDE
+    {
+        return "threadRecorder";
+    }
+
+    QList<QThread*> workThreads;
+    QList<QThread*> commitThreads;
+
+private:
+    QMutex mMutex;
+};
+
+//Indexes the summary. Modifications of the initial summary take longer, so their results are ready last.
+class SlowSummaryIndexer : public Akonadi2::ConcurrentPreprocessor
+{
+public:
+    SlowSummaryIndexer(Akonadi2::Pipeline *pipeline, const DomainTypeAdaptorFactoryInterface::Ptr &factory)
+        : Akonadi2::ConcurrentPreprocessor(),
+        mPipeline(pipeline),
+        mFactory(factory)
+    {
+    }
+
+    std::function<void()> processConcurrently(const QByteArray &key, const Akonadi2::Entity &entity) Q_DECL_OVERRIDE
+    {
+        const auto value = summary(entity);
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        return [pipeline, key, value]() {
+            pipeline->index("testsummary").add(value, key);
+        };
+    }
+
+    std::function<void()> processModificationConcurrently(const QByteArray &key, const Akonadi2::Entity &oldEntity, const Akonadi2::Entity &newEntity) Q_DECL_OVERRIDE
+    {
+        const auto oldValue = summary(oldEntity);
+        const auto newValue = summary(newEntity);
+        if (oldValue == Index::encodeValue(QString("summary"))) {
+            QThread::msleep(200);
+        }
+        Akonadi2::Pipeline *pipeline = mPipeline;
+        return [pipeline, key, oldValue, newValue]() {
+            pipeline->index("testsummary").replace(oldValue, newValue, key);
+        };
+    }
+
+    QString id() const Q_DECL_OVERRIDE
+    {
+        return "summaryIndexer";
+    }
+
+    QStringList writtenIndexes() const Q_DECL_OVERRIDE
+    {
+        return QStringList() << "testsummary";
+    }
+
+private:
+    QByteArray summary(const Akonadi2::Entity &entity) const
+    {
+        return Index::encodeValue(mFactory->createAdaptor(entity)->getProperty("summary"));
+    }
+
+    Akonadi2::Pipeline *mPipeline;
+    DomainTypeAdaptorFactoryInterface::Ptr mFactory;
+};
+
+//Its queued connections show when the event loop got control again
+class Marker : public QObject
+{
+    Q_OBJECT
+Q_SIGNALS:
+    void marked();
+};
+
+class PipelineTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase()
+    {
+        cleanup();
+    }
+
+    void cleanup()
+    {
+        removeFromDisk("org.kde.pipelinetest");
+        removeFromDisk("org.kde.pipelinetest.progress");
+        removeFromDisk("org.kde.pipelinetest.tombstones");
+        removeFromDisk("org.kde.pipelinetest.oldentities");
+        removeFromDisk("org.kde.pipelinetest.index.testsummary");
+    }
+
+    void testConcurrentPreprocessorRunsOnThreadPool()
+    {
+        DummyEventAdaptorFactory factory;
+        ThreadRecordingPreprocessor preprocessor;
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &preprocessor);
+
+        QVector<QByteArray> commands;
+        for (int i = 0; i < 10; i++) {
+            commands << createEntityCommand(factory, QString("uid%1").arg(i));
+        }
+        auto future = pipeline.newEntities(commands).exec();
+        QVERIFY(!future.errorCode());
+        QTRY_VERIFY(!pipeline.isProcessing());
+
+        //The work runs on the pool, the writes on the pipeline thread
+        QCOMPARE(preprocessor.workThreads.size(), 10);
+        QVERIFY(!preprocessor.workThreads.contains(QThread::currentThread()));
+        QCOMPARE(preprocessor.commitThreads.size(), 10);
+        QCOMPARE(preprocessor.commitThreads.toSet(), QSet<QThread*>() << QThread::currentThread());
+    }
+
+    void testDependencyOrder()
+    {
+        DummyEventAdaptorFactory factory;
+        QStringList log;
+        LoggingPreprocessor writer("writer", QList<QByteArray>(), QList<QByteArray>() << "summary", log, true);
+        LoggingPreprocessor reader("reader", QList<QByteArray>() << "summary", QList<QByteArray>(), log);
+        LoggingPreprocessor independent("independent", QList<QByteArray>() << "uid", QList<QByteArray>(), log);
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &writer << &reader << &independent);
+
+        const QByteArray command = createEntityCommand(factory, "orderuid");
+        auto future = pipeline.newEntity(command.constData(), command.size()).exec();
+        QVERIFY(!future.errorCode());
+
+        //The independent preprocessor doesn't wait for the writer, the reader of the written property does
+        QTRY_COMPARE(log, QStringList() << "writer" << "independent");
+        QTest::qWait(50);
+        QCOMPARE(log, QStringList() << "writer" << "independent");
+        QVERIFY(pipeline.isProcessing());
+
+        writer.complete();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(log, QStringList() << "writer" << "independent" << "reader");
+    }
+
+    void testSkipUnchangedReadProperties()
+    {
+        auto factory = QSharedPointer<DummyEventAdaptorFactory>::create();
+        QStringList log;
+        LoggingPreprocessor summaryReader("summaryReader", QList<QByteArray>() << "summary", QList<QByteArray>(), log);
+        LoggingPreprocessor uidReader("uidReader", QList<QByteArray>() << "uid", QList<QByteArray>(), log);
+        //Depends on the whole entity, so it always runs
+        LoggingPreprocessor entityReader("entityReader", QList<QByteArray>(), QList<QByteArray>() << "description", log);
+        const auto preprocessors = QVector<Akonadi2::Preprocessor*>() << &summaryReader << &uidReader << &entityReader;
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        pipeline.setAdaptorFactory("event", factory);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, preprocessors);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, preprocessors);
+
+        const QByteArray command = createEntityCommand(*factory, "skipuid");
+        pipeline.newEntity(command.constData(), command.size()).exec();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(log, QStringList() << "summaryReader" << "uidReader" << "entityReader");
+
+        //Only the summary changes, so the uid reader is skipped
+        log.clear();
+        const QByteArray modifyCommand = modifyEntityCommand(*factory, summaryReader.lastKey, "modified");
+        auto future = pipeline.modifiedEntity(modifyCommand.constData(), modifyCommand.size()).exec();
+        QVERIFY(!future.errorCode());
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(log, QStringList() << "summaryReader" << "entityReader");
+    }
+
+    void testConsecutiveModifications()
+    {
+        auto factory = QSharedPointer<DummyEventAdaptorFactory>::create();
+        QStringList log;
+        LoggingPreprocessor keyRecorder("keyRecorder", QList<QByteArray>() << "uid", QList<QByteArray>(), log);
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        SlowSummaryIndexer indexer(&pipeline, factory);
+        pipeline.setAdaptorFactory("event", factory);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &indexer << &keyRecorder);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, QVector<Akonadi2::Preprocessor*>() << &indexer);
+
+        const QByteArray command = createEntityCommand(*factory, "modifieduid");
+        pipeline.newEntity(command.constData(), command.size()).exec();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        const QByteArray key = keyRecorder.lastKey;
+
+        //The second modification waits for the pipeline of the first one, although its result would be ready first
+        const QByteArray firstModification = modifyEntityCommand(*factory, key, "v1");
+        const QByteArray secondModification = modifyEntityCommand(*factory, key, "v2");
+        auto first = pipeline.modifiedEntity(firstModification.constData(), firstModification.size()).exec();
+        auto second = pipeline.modifiedEntity(secondModification.constData(), secondModification.size()).exec();
+        QVERIFY(first.isFinished());
+        QVERIFY(!second.isFinished());
+        QTRY_VERIFY(second.isFinished());
+        QVERIFY(!second.errorCode());
+        QTRY_VERIFY(!pipeline.isProcessing());
+
+        const auto lookup = [&pipeline](const QString &value) {
+            QList<QByteArray> keys;
+            pipeline.index("testsummary").lookup(Index::encodeValue(value), [&keys](const QByteArray &key) {
+                keys << key;
+            },
+            [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+            return keys;
+        };
+        QCOMPARE(lookup("summary"), QList<QByteArray>());
+        QCOMPARE(lookup("v1"), QList<QByteArray>());
+        QCOMPARE(lookup("v2"), QList<QByteArray>() << key);
+    }
+
+    void testResumeConsecutiveModification()
+    {
+        auto factory = QSharedPointer<DummyEventAdaptorFactory>::create();
+        QStringList log;
+        QByteArray key;
+        {
+            QStringList newLog;
+            LoggingPreprocessor keyRecorder("keyRecorder", QList<QByteArray>(), QList<QByteArray>(), newLog);
+            LoggingPreprocessor preprocessor("preprocessor", QList<QByteArray>(), QList<QByteArray>(), log, true);
+            Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+            pipeline.setAdaptorFactory("event", factory);
+            pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &keyRecorder);
+            pipeline.setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, QVector<Akonadi2::Preprocessor*>() << &preprocessor);
+
+            const QByteArray command = createEntityCommand(*factory, "resumeuid");
+            pipeline.newEntity(command.constData(), command.size()).exec();
+            QTRY_VERIFY(!pipeline.isProcessing());
+            key = keyRecorder.lastKey;
+            const QByteArray firstModification = modifyEntityCommand(*factory, key, "v1");
+            const QByteArray secondModification = modifyEntityCommand(*factory, key, "v2");
+            pipeline.modifiedEntity(firstModification.constData(), firstModification.size()).exec();
+            pipeline.modifiedEntity(secondModification.constData(), secondModification.size()).exec();
+            QTRY_COMPARE(log.size(), 1);
+
+            //The first pipeline completes and the second one starts, but the resource goes away before it completed
+            preprocessor.complete();
+            QTRY_COMPARE(log.size(), 2);
+            QTest::qWait(50);
+            QVERIFY(pipeline.isProcessing());
+        }
+
+        //The records of the second pipeline survived the completion of the first one
+        log.clear();
+        LoggingPreprocessor preprocessor("preprocessor", QList<QByteArray>(), QList<QByteArray>(), log);
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        pipeline.setAdaptorFactory("event", factory);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, QVector<Akonadi2::Preprocessor*>() << &preprocessor);
+        pipeline.resumePipelines();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(log, QStringList() << "preprocessor");
+        QCOMPARE(preprocessor.lastKey, key);
+    }
+
+    void testMigrateEntityKeys()
+    {
+        auto factory = QSharedPointer<DummyEventAdaptorFactory>::create();
+        QStringList log;
+        LoggingPreprocessor keyRecorder("keyRecorder", QList<QByteArray>(), QList<QByteArray>(), log);
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        SlowSummaryIndexer indexer(&pipeline, factory);
+        pipeline.setAdaptorFactory("event", factory);
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &indexer << &keyRecorder);
+
+        const QByteArray command = createEntityCommand(*factory, "legacyuid");
+        pipeline.newEntity(command.constData(), command.size()).exec();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        const QByteArray key = keyRecorder.lastKey;
+        const QByteArray legacyKey = Akonadi2::Storage::printableKey(key);
+
+        //Store the entity the way it was stored before binary keys were introduced
+        auto &storage = pipeline.storage();
+        QByteArray entity;
+        storage.scan(key.toStdString(), [&entity](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+            entity = QByteArray(static_cast<char*>(valuePtr), valueSize);
+            return false;
+        });
+        QVERIFY(!entity.isEmpty());
+        storage.write(legacyKey.constData(), legacyKey.size(), entity.constData(), entity.size());
+        storage.remove(key.constData(), key.size());
+
+        QCOMPARE(pipeline.migrateEntityKeys(), 1);
+        QCOMPARE(pipeline.migrateEntityKeys(), 0);
+        QVERIFY(pipeline.rebuildIndexes("event"));
+
+        int legacyEntities = 0;
+        storage.scan(legacyKey.toStdString(), [&legacyEntities](void *, int, void *, int) -> bool {
+            legacyEntities++;
+            return true;
+        });
+        QCOMPARE(legacyEntities, 0);
+        QList<QByteArray> keys;
+        pipeline.index("testsummary").lookup(Index::encodeValue(QString("summary")), [&keys](const QByteArray &key) {
+            keys << key;
+        },
+        [](const Index::Error &error) { qWarning() << "Error: " << QString::fromStdString(error.message); });
+        QCOMPARE(keys, QList<QByteArray>() << key);
+
+        //The entity can be modified by its printable id again
+        const qint64 revision = storage.maxRevision();
+        const QByteArray modification = modifyEntityCommand(*factory, key, "migrated");
+        auto future = pipeline.modifiedEntity(modification.constData(), modification.size()).exec();
+        QVERIFY(!future.errorCode());
+        QCOMPARE(storage.maxRevision(), revision + 1);
+    }
+
+    void testStepsPerIteration()
+    {
+        DummyEventAdaptorFactory factory;
+        QStringList log;
+        LoggingPreprocessor preprocessor("preprocessor", QList<QByteArray>(), QList<QByteArray>(), log);
+        Akonadi2::Pipeline pipeline("org.kde.pipelinetest");
+        pipeline.setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << &preprocessor);
+        Marker marker;
+        QObject::connect(&marker, &Marker::marked, &marker, [&log]() {
+            log << "eventloop";
+        }, Qt::QueuedConnection);
+        const QVector<QByteArray> commands = QVector<QByteArray>() << createEntityCommand(factory, "uid1") << createEntityCommand(factory, "uid2") << createEntityCommand(factory, "uid3");
+
+        //All ready states are stepped within one iteration
+        pipeline.newEntities(commands).exec();
+        emit marker.marked();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QTRY_COMPARE(log.size(), 4);
+        QCOMPARE(log, QStringList() << "preprocessor" << "preprocessor" << "preprocessor" << "eventloop");
+
+        //Other events are processed in between the steps
+        log.clear();
+        pipeline.setStepsPerIteration(1);
+        pipeline.newEntities(commands).exec();
+        emit marker.marked();
+        QTRY_VERIFY(!pipeline.isProcessing());
+        QCOMPARE(log, QStringList() << "preprocessor" << "eventloop" << "preprocessor" << "preprocessor");
+    }
+};
+
+QTEST_MAIN(PipelineTest)
+#include "pipelinetest.moc"
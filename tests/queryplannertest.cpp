@@ -0,0 +1,125 @@
+#include <QtTest>
+
+#include <QString>
+
+#include "clientapi.h"
+#include "storage.h"
+#include "index.h"
+#include "queryplanner.h"
+
+static const QStringList s_indexNames = QStringList() << "summary" << "startTime" << "fulltext";
+
+class QueryPlannerTest : public QObject
+{
+    Q_OBJECT
+
+    QSharedPointer<Index> index(const QString &name)
+    {
+        return QSharedPointer<Index>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy.testplanner." + name, Akonadi2::Storage::ReadWrite);
+    }
+
+    QueryPlanner planner()
+    {
+        QueryPlanner planner([this](const QString &name) { return index(name); });
+        planner.addIndex(QList<QByteArray>() << "summary");
+        planner.addIndex(QList<QByteArray>() << "startTime");
+        planner.setFullTextIndex("fulltext");
+        return planner;
+    }
+
+    QList<QByteArray> execute(const QueryPlanner &planner, const QueryPlanner::Plan &plan)
+    {
+        QList<QByteArray> keys;
+        planner.execute(plan, [&keys](const QByteArray &key) -> bool {
+            keys << key;
+            return true;
+        });
+        return keys;
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        cleanup();
+    }
+
+    void cleanup()
+    {
+        for (const auto &name : s_indexNames) {
+            Akonadi2::Storage store(Akonadi2::Store::storageLocation(), "org.kde.dummy.testplanner." + name, Akonadi2::Storage::ReadWrite);
+            store.removeFromDisk();
+        }
+    }
+
+    void testFullScan()
+    {
+        Akonadi2::Query query;
+        query.propertyFilter.insert("description", "value");
+        const auto plan = planner().plan(query);
+        QVERIFY(plan.paths.isEmpty());
+        QCOMPARE(QueryPlanner::explain(plan), QString("full scan"));
+    }
+
+    void testIntersection()
+    {
+        auto summaryIndex = index("summary");
+        auto fullTextIndex = index("fulltext");
+        for (int i = 0; i < 20; i++) {
+            const QByteArray key = "key" + QByteArray::number(i);
+            summaryIndex->add(Index::encodeKey(QVariantList() << "summary"), key);
+            if (i % 4 == 0) {
+                fullTextIndex->add("rare", key);
+            }
+        }
+
+        Akonadi2::Query query;
+        query.propertyFilter.insert("summary", "summary");
+        query.textSearch = "rare";
+        const auto plan = planner().plan(query);
+        QCOMPARE(plan.paths.size(), 2);
+        //The rarer word drives the query
+        QCOMPARE(plan.paths.first().index, QString("fulltext"));
+        QCOMPARE(plan.paths.first().estimate, 5);
+        QVERIFY(QueryPlanner::explain(plan).contains("intersect with index summary"));
+        QCOMPARE(execute(planner(), plan).size(), 5);
+    }
+
+    void testUnion()
+    {
+        auto summaryIndex = index("summary");
+        summaryIndex->add(Index::encodeKey(QVariantList() << "summary1"), "key1");
+        summaryIndex->add(Index::encodeKey(QVariantList() << "summary2"), "key2");
+        summaryIndex->add(Index::encodeKey(QVariantList() << "summary3"), "key3");
+
+        Akonadi2::Query query;
+        query.propertyFilter.insert("summary", QVariantList() << "summary1" << "summary3");
+        const auto plan = planner().plan(query);
+        QCOMPARE(plan.paths.size(), 1);
+        QCOMPARE(execute(planner(), plan), QList<QByteArray>() << "key1" << "key3");
+    }
+
+    void testOrderedWalkWithLimit()
+    {
+        auto startIndex = index("startTime");
+        auto fullTextIndex = index("fulltext");
+        for (int i = 0; i < 100; i++) {
+            const QByteArray key = "key" + QByteArray::number(i);
+            startIndex->add(Index::encodeKey(QVariantList() << i), key);
+            fullTextIndex->add("common", key);
+        }
+
+        Akonadi2::Query query;
+        query.textSearch = "common";
+        query.sortProperty = "startTime";
+        query.sortDescending = true;
+        query.limit = 2;
+        const auto plan = planner().plan(query);
+        QVERIFY(plan.sorted);
+        QCOMPARE(plan.paths.first().index, QString("startTime"));
+        QVERIFY(plan.paths.first().ordered);
+        QCOMPARE(execute(planner(), plan).mid(0, 2), QList<QByteArray>() << "key99" << "key98");
+    }
+};
+
+QTEST_MAIN(QueryPlannerTest)
+#include "queryplannertest.moc"
@@ -194,6 +194,39 @@ private Q_SLOTS:
             storage2.removeFromDisk();
         }
     }
+
+    void testAppendDuplicates()
+    {
+        Akonadi2::Storage storage(testDataPath, dbName, Akonadi2::Storage::ReadWrite, true);
+        storage.startTransaction();
+        QVERIFY(storage.append("key1", 4, "value1", 6));
+        QVERIFY(storage.append("key1", 4, "value2", 6));
+        QVERIFY(storage.append("key2", 4, "value1", 6));
+        //Values out of order are rejected
+        QVERIFY(!storage.append("key1", 4, "value3", 6));
+        storage.commitTransaction();
+
+        int count = 0;
+        storage.scanRange(QByteArray(), QByteArray(), false, [&count](void *, int, void *, int) -> bool {
+            count++;
+            return true;
+        }, Akonadi2::Storage::basicErrorHandler());
+        QCOMPARE(count, 3);
+    }
+
+    void testEntityKeys()
+    {
+        const auto key = Akonadi2::Storage::createEntityKey();
+        QCOMPARE(key.size(), 16);
+        const auto printable = Akonadi2::Storage::printableKey(key);
+        QCOMPARE(printable.size(), 38);
+        QCOMPARE(Akonadi2::Storage::entityKey(printable), key);
+
+        //Legacy keys are left untouched
+        const QByteArray legacyKey("{legacy}");
+        QCOMPARE(Akonadi2::Storage::printableKey(legacyKey), legacyKey);
+        QCOMPARE(Akonadi2::Storage::entityKey(legacyKey), legacyKey);
+    }
 };
 
 QTEST_MAIN(StorageTest)